@@ -0,0 +1,188 @@
+#include "deque.h"
+
+#include <stdlib.h>
+
+/* Circular buffer.  'size' is always a power of two. */
+struct deque_array {
+    long size;
+    struct deque_array * next;      /* on the retired list */
+    _Atomic(void *) buf[];
+};
+
+static struct deque_array *
+array_new (long size)
+{
+  struct deque_array *a = malloc (sizeof *a + size * sizeof a->buf[0]);
+  if (a == NULL)
+    return NULL;
+  a->size = size;
+  a->next = NULL;
+  return a;
+}
+
+static inline void *
+array_get (struct deque_array *a, long i)
+{
+  return atomic_load_explicit (&a->buf[i & (a->size - 1)],
+                               memory_order_relaxed);
+}
+
+static inline void
+array_put (struct deque_array *a, long i, void *x)
+{
+  atomic_store_explicit (&a->buf[i & (a->size - 1)], x,
+                         memory_order_relaxed);
+}
+
+/* Initializes D as an empty deque that can hold CAPACITY elements
+   before it first needs to grow.  CAPACITY must be a power of two. */
+bool
+deque_init (struct deque *d, size_t capacity)
+{
+  struct deque_array *a = array_new (capacity);
+  if (a == NULL)
+    return false;
+
+  atomic_init (&d->top, 0);
+  atomic_init (&d->bottom, 0);
+  atomic_init (&d->array, a);
+  d->retired = NULL;
+  return true;
+}
+
+/* Frees the buffers of D.  No thread may be using D. */
+void
+deque_destroy (struct deque *d)
+{
+  free (atomic_load_explicit (&d->array, memory_order_relaxed));
+  while (d->retired != NULL)
+    {
+      struct deque_array *a = d->retired;
+      d->retired = a->next;
+      free (a);
+    }
+}
+
+/* Replaces the buffer of D, which holds the elements T..B-1, with
+   one twice as large. */
+static struct deque_array *
+deque_grow (struct deque *d, struct deque_array *a, long t, long b)
+{
+  struct deque_array *n = array_new (a->size * 2);
+  if (n == NULL)
+    return NULL;
+
+  long i;
+  for (i = t; i < b; i++)
+    array_put (n, i, array_get (a, i));
+
+  a->next = d->retired;
+  d->retired = a;
+  atomic_store_explicit (&d->array, n, memory_order_release);
+  return n;
+}
+
+/* Pushes X onto the bottom of D.  Returns false if the deque was
+   full and could not grow. */
+bool
+deque_push (struct deque *d, void *x)
+{
+  long b = atomic_load_explicit (&d->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit (&d->top, memory_order_acquire);
+  struct deque_array *a = atomic_load_explicit (&d->array,
+                                                memory_order_relaxed);
+  if (b - t > a->size - 1)
+    {
+      a = deque_grow (d, a, t, b);
+      if (a == NULL)
+        return false;
+    }
+  array_put (a, b, x);
+  atomic_store_explicit (&d->bottom, b + 1, memory_order_release);
+  return true;
+}
+
+/* Pushes the N elements XS onto the bottom of D, XS[N-1] ending up
+   at the bottom.  They become visible to thieves all at once.
+   Returns false if the deque could not grow to hold them. */
+bool
+deque_push_batch (struct deque *d, void **xs, size_t n)
+{
+  long b = atomic_load_explicit (&d->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit (&d->top, memory_order_acquire);
+  struct deque_array *a = atomic_load_explicit (&d->array,
+                                                memory_order_relaxed);
+  while (b - t + (long) n > a->size)
+    {
+      a = deque_grow (d, a, t, b);
+      if (a == NULL)
+        return false;
+    }
+
+  size_t i;
+  for (i = 0; i < n; i++)
+    array_put (a, b + i, xs[i]);
+  atomic_store_explicit (&d->bottom, b + n, memory_order_release);
+  return true;
+}
+
+/* Pops the element at the bottom of D, or returns NULL if D is
+   empty. */
+void *
+deque_pop (struct deque *d)
+{
+  long b = atomic_load_explicit (&d->bottom, memory_order_relaxed) - 1;
+  struct deque_array *a = atomic_load_explicit (&d->array,
+                                                memory_order_relaxed);
+  atomic_store_explicit (&d->bottom, b, memory_order_relaxed);
+  atomic_thread_fence (memory_order_seq_cst);
+  long t = atomic_load_explicit (&d->top, memory_order_relaxed);
+
+  void *x = NULL;
+  if (t <= b)
+    {
+      x = array_get (a, b);
+      if (t == b)
+        {
+          /* last element: race against thieves for it */
+          if (!atomic_compare_exchange_strong_explicit (&d->top, &t, t + 1,
+                                                        memory_order_seq_cst,
+                                                        memory_order_relaxed))
+            x = NULL;
+          atomic_store_explicit (&d->bottom, b + 1, memory_order_relaxed);
+        }
+    }
+  else
+    atomic_store_explicit (&d->bottom, b + 1, memory_order_relaxed);
+  return x;
+}
+
+/* Steals the element at the top of D.  Returns NULL if D is empty
+   and DEQUE_ABORT if another thread got there first. */
+void *
+deque_steal (struct deque *d)
+{
+  long t = atomic_load_explicit (&d->top, memory_order_acquire);
+  atomic_thread_fence (memory_order_seq_cst);
+  long b = atomic_load_explicit (&d->bottom, memory_order_acquire);
+
+  if (t >= b)
+    return NULL;
+
+  struct deque_array *a = atomic_load_explicit (&d->array,
+                                                memory_order_acquire);
+  void *x = array_get (a, t);
+  if (!atomic_compare_exchange_strong_explicit (&d->top, &t, t + 1,
+                                                memory_order_seq_cst,
+                                                memory_order_relaxed))
+    return DEQUE_ABORT;
+  return x;
+}
+
+long
+deque_size (struct deque *d)
+{
+  long b = atomic_load_explicit (&d->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit (&d->top, memory_order_relaxed);
+  return b > t ? b - t : 0;
+}
@@ -0,0 +1,55 @@
+#ifndef __DEQUE_H
+#define __DEQUE_H
+/* Lock-free work-stealing deque.
+
+   This is the growable circular deque described by Chase and Lev
+   ("Dynamic Circular Work-Stealing Deque", SPAA 2005), using the
+   C11 memory orderings given by Le, Pop, Cohen and Zappa Nardelli
+   ("Correct and Efficient Work-Stealing for Weak Memory Models",
+   PPoPP 2013).
+
+   A deque has exactly one owner thread, which pushes and pops
+   elements at the bottom end.  Any number of other threads
+   ("thieves") may concurrently steal elements from the top end.
+   Only the owner may call deque_push(), deque_push_batch() and
+   deque_pop(); any thread may call deque_steal() and deque_size().
+
+   When the circular buffer fills up, the owner replaces it with
+   one twice as large.  Thieves may still be reading the old
+   buffer, so it is not freed until deque_destroy(). */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Returned by deque_steal() if it lost a race with another thief
+   or with the owner.  The caller may retry. */
+#define DEQUE_ABORT ((void *) 1)
+
+struct deque_array;
+
+struct deque {
+    /* thieves CAS top, the owner writes bottom; keep them on
+     * separate cache lines */
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    _Atomic(struct deque_array *) array;
+    struct deque_array * retired;   /* buffers replaced by a grow */
+};
+
+bool deque_init (struct deque *, size_t capacity);
+void deque_destroy (struct deque *);
+
+/* Owner only. */
+bool deque_push (struct deque *, void *);
+bool deque_push_batch (struct deque *, void **, size_t n);
+void *deque_pop (struct deque *);
+
+/* Any thread.  Returns NULL if the deque was empty. */
+void *deque_steal (struct deque *);
+
+/* Approximate number of elements; exact only if no thread is
+   concurrently operating on the deque. */
+long deque_size (struct deque *);
+
+#endif /* deque.h */
@@ -13,6 +13,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -43,8 +44,10 @@ fibonacci(struct thread_pool * pool, void * _data)
 }
 
 static void usage(char *av0, int nthreads) {
-    fprintf(stderr, "Usage: %s [-d <n>] [-n <n>] <N>\n"
+    fprintf(stderr, "Usage: %s [-d <n>] [-n <n>] [-F] [-t] <N>\n"
                     " -n        number of threads in pool, default %d\n"
+                    " -F        run tasks on fibers\n"
+                    " -t        time how long tasks run\n"
                     , av0, nthreads);
     exit(0);
 }
@@ -53,12 +56,19 @@ int
 main(int ac, char *av[])
 {
     int nthreads = 4;
+    bool fibers = false, busy_time = false;
     int c;
-    while ((c = getopt(ac, av, "n:h")) != EOF) {
+    while ((c = getopt(ac, av, "n:Fth")) != EOF) {
         switch (c) {
         case 'n':
             nthreads = atoi(optarg);
             break;
+        case 'F':
+            fibers = true;
+            break;
+        case 't':
+            busy_time = true;
+            break;
         case 'h':
             usage(av[0], nthreads);
         }
@@ -67,7 +77,11 @@ main(int ac, char *av[])
         usage(av[0], nthreads);
 
     int n = atoi(av[optind]);
-    struct thread_pool * pool = thread_pool_new(nthreads);
+    struct thread_pool_options opts;
+    thread_pool_options_init(&opts, nthreads);
+    opts.fibers = fibers;
+    opts.record_busy_time = busy_time;
+    struct thread_pool * pool = thread_pool_new_with_options(&opts);
 
     struct problem_parameters roottask = { .n = n };
 
@@ -89,6 +103,17 @@ main(int ac, char *av[])
         abort();
     } else {
         printf("result ok.\n");
+        printf("futures carved from slabs: %zu\n", thread_pool_slab_futures(pool));
+        struct thread_pool_stats stats;
+        thread_pool_get_stats(pool, &stats);
+        printf("tasks: %lu, %lu popped locally, %lu from the global queues\n",
+               stats.tasks, stats.local_pops, stats.global_pops);
+        printf("steals: %lu of %lu attempts\n", stats.steals, stats.steal_attempts);
+        if (busy_time) {
+            printf("busy: %.3fms\n", stats.busy_ns / 1e6);
+        }
+        printf("idle: %.3fms spinning, %.3fms yielding, %.3fms parked\n",
+               stats.spin_ns / 1e6, stats.yield_ns / 1e6, stats.park_ns / 1e6);
         report_benchmark_results(bdata);
     }
 
@@ -0,0 +1,112 @@
+#include "fiber.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef FIBER_FAST_SWITCH
+/* Pushes the callee-saved registers and the SSE and x87 control
+   words, stores the stack pointer in *SAVE, and pops the same from
+   the stack at SP. */
+void fiber_swap (void **save, void *sp);
+__asm__ (".text\n"
+         ".globl fiber_swap\n"
+         ".hidden fiber_swap\n"
+         ".type fiber_swap, @function\n"
+         "fiber_swap:\n"
+         "\tpushq %rbp\n"
+         "\tpushq %rbx\n"
+         "\tpushq %r12\n"
+         "\tpushq %r13\n"
+         "\tpushq %r14\n"
+         "\tpushq %r15\n"
+         "\tsubq $8, %rsp\n"
+         "\tstmxcsr (%rsp)\n"
+         "\tfnstcw 4(%rsp)\n"
+         "\tmovq %rsp, (%rdi)\n"
+         "\tmovq %rsi, %rsp\n"
+         "\tldmxcsr (%rsp)\n"
+         "\tfldcw 4(%rsp)\n"
+         "\taddq $8, %rsp\n"
+         "\tpopq %r15\n"
+         "\tpopq %r14\n"
+         "\tpopq %r13\n"
+         "\tpopq %r12\n"
+         "\tpopq %rbx\n"
+         "\tpopq %rbp\n"
+         "\tret\n"
+         ".size fiber_swap, .-fiber_swap\n");
+#endif
+
+/* Initializes F to run ENTRY on a fresh stack of at least
+   STACK_SIZE bytes.  Returns false if the stack could not be
+   mapped. */
+bool
+fiber_init (struct fiber *f, size_t stack_size, void (*entry) (void))
+{
+  size_t page = sysconf (_SC_PAGESIZE);
+  size_t size = (stack_size + page - 1) / page * page + page;
+
+  f->map = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (f->map == MAP_FAILED)
+    {
+      f->map = NULL;
+      return false;
+    }
+  f->map_size = size;
+
+  /* stacks grow down, so the guard goes at the low end */
+  if (mprotect (f->map, page, PROT_NONE) != 0)
+    {
+      fiber_destroy (f);
+      return false;
+    }
+
+#ifdef FIBER_FAST_SWITCH
+  /* lay out what fiber_swap() pops: the control words of this
+     thread, zeroed registers, then ENTRY to return to.  ENTRY finds
+     the stack aligned as if it had been called, with a null return
+     address it must never use. */
+  void **sp = (void **) (((uintptr_t) f->map + size) & ~(uintptr_t) 15) - 9;
+  memset (sp, 0, 9 * sizeof *sp);
+  __asm__ ("stmxcsr %0\n\tfnstcw %1"
+           : "=m" (*(uint32_t *) sp), "=m" (*((uint16_t *) sp + 2)));
+  sp[7] = (void *) entry;
+  f->sp = sp;
+#else
+  if (getcontext (&f->ctx) != 0)
+    {
+      fiber_destroy (f);
+      return false;
+    }
+  f->ctx.uc_stack.ss_sp = (char *) f->map + page;
+  f->ctx.uc_stack.ss_size = size - page;
+  f->ctx.uc_link = NULL;
+  makecontext (&f->ctx, entry, 0);
+#endif
+  return true;
+}
+
+/* Unmaps the stack of F, which must not be running. */
+void
+fiber_destroy (struct fiber *f)
+{
+  if (f->map != NULL)
+    munmap (f->map, f->map_size);
+  f->map = NULL;
+}
+
+/* Saves the current context in FROM and resumes TO. */
+void
+fiber_switch (struct fiber *from, struct fiber *to)
+{
+#ifdef FIBER_FAST_SWITCH
+  fiber_swap (&from->sp, to->sp);
+#else
+  if (swapcontext (&from->ctx, &to->ctx) != 0)
+    printf ("Error switching fibers.\n");
+#endif
+}
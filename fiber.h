@@ -0,0 +1,47 @@
+#ifndef __FIBER_H
+#define __FIBER_H
+/* Stackful coroutines on top of ucontext.
+
+   A fiber is an execution context with a stack of its own.
+   fiber_switch() saves the calling context in one fiber and resumes
+   another on the same thread.  A fiber that has not yet run starts
+   in the entry function given to fiber_init(); the entry function
+   must never return.
+
+   A thread's original stack can be switched away from and back to
+   through a fiber that was never passed to fiber_init().
+
+   Stacks are mmap'd with an inaccessible guard page below them, so
+   a fiber that overflows its stack faults instead of silently
+   corrupting memory.
+
+   swapcontext() saves and restores the signal mask, two system
+   calls per switch.  On x86-64, fiber_switch() instead saves only
+   the registers a called function must preserve, in a few
+   instructions, and all fibers of a thread share its signal mask.
+   Sanitizer builds keep ucontext, whose switches they follow. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <ucontext.h>
+
+#if defined(__x86_64__) && !defined(__SANITIZE_ADDRESS__) \
+    && !defined(__SANITIZE_THREAD__)
+#define FIBER_FAST_SWITCH 1
+#endif
+
+struct fiber {
+#ifdef FIBER_FAST_SWITCH
+    void *sp;                   /* where its registers were saved */
+#else
+    ucontext_t ctx;
+#endif
+    void *map;                  /* stack mapping including guard page */
+    size_t map_size;
+};
+
+bool fiber_init (struct fiber *, size_t stack_size, void (*entry) (void));
+void fiber_destroy (struct fiber *);
+void fiber_switch (struct fiber *from, struct fiber *to);
+
+#endif /* fiber.h */
@@ -25,13 +25,20 @@
 #define SERIAL_MERGE_SORT_THRESHOLD    1000
 static int min_task_size = SERIAL_MERGE_SORT_THRESHOLD;
 
+/* When to merge with par_merge_int instead of serially */
+#define PARALLEL_MERGE_THRESHOLD    100000
+static int parallel_merge_threshold = PARALLEL_MERGE_THRESHOLD;
+
 #define INSERTION_SORT_THRESHOLD    16
 static int insertion_sort_threshold = INSERTION_SORT_THRESHOLD;
 
 #include "threadpool.h"
 #include "threadpool_lib.h"
+#include "parallel.h"
 #define DEFAULT_THREADS 4
 static int nthreads = DEFAULT_THREADS;
+static enum thread_pool_placement placement = THREAD_POOL_PLACE_NONE;
+static bool fibers = false;
 
 typedef void (*sort_func)(int *, int);
 
@@ -135,6 +142,32 @@ struct msort_task {
     int left, right;
 }; 
 
+/* Copy range for a parallel copy of a run into tmp */
+struct copy_range {
+    int *dst;
+    const int *src;
+};
+
+static void
+copy_range(struct thread_pool * threadpool, long begin, long end, void * data)
+{
+    struct copy_range * c = data;
+    memcpy(c->dst + begin, c->src + begin, (end - begin) * sizeof (int));
+}
+
+/* Merge array[left..m] and array[m+1..right] with par_merge_int,
+ * through tmp[left..right] */
+static void
+merge_parallel(struct thread_pool * threadpool, int * array, int * tmp, int left, int m, int right)
+{
+    if (array[m] <= array[m+1])
+        return;
+
+    struct copy_range c = { .dst = tmp + left, .src = array + left };
+    thread_pool_parallel_for(threadpool, 0, right - left + 1, copy_range, &c);
+    par_merge_int(threadpool, tmp + left, m - left + 1, tmp + m + 1, right - m, array + left);
+}
+
 /* Parallel mergesort */
 static void  
 mergesort_internal_parallel(struct thread_pool * threadpool, struct msort_task * s)
@@ -155,7 +188,8 @@ mergesort_internal_parallel(struct thread_pool * threadpool, struct msort_task *
             .array = array,
             .tmp = tmp
         };
-        struct future * lhalf = thread_pool_submit(threadpool, 
+        struct future_storage lstorage;
+        struct future * lhalf = thread_pool_submit_into(threadpool, &lstorage,
                                    (fork_join_task_t) mergesort_internal_parallel,  
                                    &mleft);
 
@@ -167,8 +201,10 @@ mergesort_internal_parallel(struct thread_pool * threadpool, struct msort_task *
         };
         mergesort_internal_parallel(threadpool, &mright);
         future_get(lhalf);
-        future_free(lhalf);
-        merge(array, tmp, left, left, m, right);
+        if (right - left + 1 >= parallel_merge_threshold)
+            merge_parallel(threadpool, array, tmp, left, m, right);
+        else
+            merge(array, tmp, left, left, m, right);
     }
 }
 
@@ -180,8 +216,27 @@ mergesort_parallel(int *array, int N)
         .left = 0, .right = N-1, .array = array, .tmp = tmp
     };
 
-    struct thread_pool * threadpool = thread_pool_new(nthreads);
+    struct thread_pool_options opts;
+    thread_pool_options_init(&opts, nthreads);
+    opts.placement = placement;
+    opts.fibers = fibers;
+    struct thread_pool * threadpool = thread_pool_new_with_options(&opts);
+    if (placement != THREAD_POOL_PLACE_NONE) {
+        int i;
+        printf("Worker placement:");
+        for (i = 0; i < nthreads; i++)
+            printf(" %d->cpu%d", i, thread_pool_worker_cpu(threadpool, i));
+        printf("\n");
+    }
     mergesort_internal_parallel(threadpool, &root);
+    if (placement != THREAD_POOL_PLACE_NONE) {
+        int node;
+        for (node = 0; node < thread_pool_get_num_nodes(threadpool); node++) {
+            unsigned long local, remote;
+            thread_pool_get_node_steal_stats(threadpool, node, &local, &remote);
+            printf("node %d: %lu local steals, %lu remote steals\n", node, local, remote);
+        }
+    }
     thread_pool_shutdown_and_destroy(threadpool);
     free (tmp);
 }
@@ -223,14 +278,18 @@ benchmark(const char *benchmark_name, sort_func sorter, int *a0, int N, bool rep
 static void
 usage(char *av0, int exvalue)
 {
-    fprintf(stderr, "Usage: %s [-i <n>] [-n <n>] [-b] [-q] [-s <n>] <N>\n"
+    fprintf(stderr, "Usage: %s [-i <n>] [-n <n>] [-p <policy>] [-M <n>] [-F] [-b] [-q] [-s <n>] <N>\n"
                     " -i        insertion sort threshold, default %d\n"
                     " -m        minimum task size before using serial mergesort, default %d\n"
+                    " -M        minimum size of a merge before merging in parallel, default %d\n"
                     " -n        number of threads in pool, default %d\n"
+                    " -p        pin workers: compact, scatter or core, default unpinned\n"
+                    " -F        run tasks on fibers\n"
                     " -b        run built-in qsort\n"
                     " -s        specify srand() seed\n"
                     " -q        also run serial mergesort\n"
-                    , av0, INSERTION_SORT_THRESHOLD, SERIAL_MERGE_SORT_THRESHOLD, DEFAULT_THREADS);
+                    , av0, INSERTION_SORT_THRESHOLD, SERIAL_MERGE_SORT_THRESHOLD,
+                    PARALLEL_MERGE_THRESHOLD, DEFAULT_THREADS);
     exit(exvalue);
 }
 
@@ -241,7 +300,7 @@ main(int ac, char *av[])
     bool run_builtin_qsort = false;
     bool run_serial_msort = false;
 
-    while ((c = getopt(ac, av, "i:n:bhs:qm:")) != EOF) {
+    while ((c = getopt(ac, av, "i:n:p:Fbhs:qm:M:")) != EOF) {
         switch (c) {
         case 'i':
             insertion_sort_threshold = atoi(optarg);
@@ -249,9 +308,25 @@ main(int ac, char *av[])
         case 'm':
             min_task_size = atoi(optarg);
             break;
+        case 'M':
+            parallel_merge_threshold = atoi(optarg);
+            break;
         case 'n':
             nthreads = atoi(optarg);
             break;
+        case 'p':
+            if (strcmp(optarg, "compact") == 0)
+                placement = THREAD_POOL_PLACE_COMPACT;
+            else if (strcmp(optarg, "scatter") == 0)
+                placement = THREAD_POOL_PLACE_SCATTER;
+            else if (strcmp(optarg, "core") == 0)
+                placement = THREAD_POOL_PLACE_PHYSICAL_CORE;
+            else
+                usage(av[0], EXIT_FAILURE);
+            break;
+        case 'F':
+            fibers = true;
+            break;
         case 's':
             srand(atoi(optarg));
             break;
@@ -280,8 +355,8 @@ main(int ac, char *av[])
     if (run_serial_msort)
         benchmark("mergesort serial", mergesort_serial, a0, N, false);
 
-    printf("Using %d threads, parallel/serials threshold=%d insertion sort threshold=%d\n", 
-        nthreads, min_task_size, insertion_sort_threshold);
+    printf("Using %d threads, parallel/serials threshold=%d insertion sort threshold=%d parallel merge threshold=%d\n", 
+        nthreads, min_task_size, insertion_sort_threshold, parallel_merge_threshold);
     benchmark("mergesort parallel", mergesort_parallel, a0, N, true);
 
     return EXIT_SUCCESS;
@@ -0,0 +1,170 @@
+#include "mpmc.h"
+
+#include <stdlib.h>
+
+/* A cell is free for the producer of position P once its sequence
+   number is P, and holds the element of position P once it is P+1.
+   The consumer that empties it sets it to P plus the capacity, the
+   position of the producer one lap later. */
+struct mpmc_cell {
+    atomic_size_t seq;
+    void *data;
+};
+
+/* Initializes Q as an empty queue of CAPACITY elements.  CAPACITY
+   must be a power of two. */
+bool
+mpmc_init (struct mpmc *q, size_t capacity)
+{
+  q->cells = malloc (capacity * sizeof *q->cells);
+  if (q->cells == NULL)
+    return false;
+
+  size_t i;
+  for (i = 0; i < capacity; i++)
+    atomic_init (&q->cells[i].seq, i);
+  q->mask = capacity - 1;
+  atomic_init (&q->tail, 0);
+  atomic_init (&q->head, 0);
+  return true;
+}
+
+/* Frees the buffer of Q.  No thread may be using Q. */
+void
+mpmc_destroy (struct mpmc *q)
+{
+  free (q->cells);
+}
+
+/* Appends X to Q.  Returns false if Q was full. */
+bool
+mpmc_push (struct mpmc *q, void *x)
+{
+  size_t pos = atomic_load_explicit (&q->tail, memory_order_relaxed);
+  struct mpmc_cell *c;
+  for (;;)
+    {
+      c = &q->cells[pos & q->mask];
+      size_t seq = atomic_load_explicit (&c->seq, memory_order_acquire);
+      long diff = (long) (seq - pos);
+      if (diff == 0)
+        {
+          if (atomic_compare_exchange_weak_explicit (&q->tail, &pos, pos + 1,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed))
+            break;
+        }
+      else if (diff < 0)
+        return false;   /* the cell still holds an element from the last lap */
+      else
+        pos = atomic_load_explicit (&q->tail, memory_order_relaxed);
+    }
+
+  c->data = x;
+  atomic_store_explicit (&c->seq, pos + 1, memory_order_release);
+  return true;
+}
+
+/* Appends up to N elements of XS to Q, in order, with a single CAS.
+   Returns how many it appended, 0 if Q was full; the rest did not
+   fit. */
+size_t
+mpmc_push_batch (struct mpmc *q, void **xs, size_t n)
+{
+  size_t pos = atomic_load_explicit (&q->tail, memory_order_relaxed);
+  size_t k;
+  for (;;)
+    {
+      /* count the free cells at the tail, up to N */
+      for (k = 0; k < n; k++)
+        {
+          struct mpmc_cell *c = &q->cells[(pos + k) & q->mask];
+          size_t seq = atomic_load_explicit (&c->seq, memory_order_acquire);
+          if (seq != pos + k)
+            break;
+        }
+
+      if (k == 0)
+        {
+          struct mpmc_cell *c = &q->cells[pos & q->mask];
+          size_t seq = atomic_load_explicit (&c->seq, memory_order_acquire);
+          long diff = (long) (seq - pos);
+          if (diff < 0)
+            return 0;   /* the cell still holds an element from the last lap */
+          /* another producer took it; catch up */
+          pos = atomic_load_explicit (&q->tail, memory_order_relaxed);
+          continue;
+        }
+
+      if (atomic_compare_exchange_weak_explicit (&q->tail, &pos, pos + k,
+                                                 memory_order_relaxed,
+                                                 memory_order_relaxed))
+        break;
+    }
+
+  size_t i;
+  for (i = 0; i < k; i++)
+    {
+      struct mpmc_cell *c = &q->cells[(pos + i) & q->mask];
+      c->data = xs[i];
+      atomic_store_explicit (&c->seq, pos + i + 1, memory_order_release);
+    }
+  return k;
+}
+
+/* Removes the element at the head of Q, or returns NULL if Q is
+   empty. */
+void *
+mpmc_pop (struct mpmc *q)
+{
+  void *x;
+  return mpmc_pop_batch (q, &x, 1) == 1 ? x : NULL;
+}
+
+/* Removes up to MAX elements from the head of Q with a single CAS
+   and stores them in XS, oldest first.  Returns how many it removed,
+   0 if Q is empty. */
+size_t
+mpmc_pop_batch (struct mpmc *q, void **xs, size_t max)
+{
+  size_t pos = atomic_load_explicit (&q->head, memory_order_relaxed);
+  size_t n;
+  for (;;)
+    {
+      /* count the filled cells at the head, up to MAX */
+      for (n = 0; n < max; n++)
+        {
+          struct mpmc_cell *c = &q->cells[(pos + n) & q->mask];
+          size_t seq = atomic_load_explicit (&c->seq, memory_order_acquire);
+          if (seq != pos + n + 1)
+            break;
+        }
+
+      if (n == 0)
+        {
+          struct mpmc_cell *c = &q->cells[pos & q->mask];
+          size_t seq = atomic_load_explicit (&c->seq, memory_order_acquire);
+          long diff = (long) (seq - (pos + 1));
+          if (diff < 0)
+            return 0;   /* empty, or its producer has not filled it yet */
+          /* another consumer took it; catch up */
+          pos = atomic_load_explicit (&q->head, memory_order_relaxed);
+          continue;
+        }
+
+      if (atomic_compare_exchange_weak_explicit (&q->head, &pos, pos + n,
+                                                 memory_order_relaxed,
+                                                 memory_order_relaxed))
+        break;
+    }
+
+  size_t i;
+  for (i = 0; i < n; i++)
+    {
+      struct mpmc_cell *c = &q->cells[(pos + i) & q->mask];
+      xs[i] = c->data;
+      atomic_store_explicit (&c->seq, pos + i + q->mask + 1,
+                             memory_order_release);
+    }
+  return n;
+}
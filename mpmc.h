@@ -0,0 +1,41 @@
+#ifndef __MPMC_H
+#define __MPMC_H
+/* Lock-free bounded multi-producer multi-consumer queue.
+
+   This is Dmitry Vyukov's bounded MPMC queue: a circular buffer of
+   cells, each tagged with a sequence number that tells producers
+   and consumers whether the cell is free for the lap they are on.
+   Producers claim a cell by advancing the tail with a CAS, and
+   consumers by advancing the head, so neither side ever waits on a
+   lock; a full or empty queue is reported rather than waited out.
+
+   Elements are dequeued in FIFO order, except that an element whose
+   producer has claimed a cell but not yet filled it holds up the
+   elements behind it. */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct mpmc_cell;
+
+struct mpmc {
+    /* producers CAS tail, consumers head; keep them on separate
+     * cache lines */
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) atomic_size_t head;
+    size_t mask;
+    struct mpmc_cell *cells;
+};
+
+bool mpmc_init (struct mpmc *, size_t capacity);
+void mpmc_destroy (struct mpmc *);
+
+/* Any thread.  mpmc_push() returns false if the queue is full,
+   mpmc_pop() NULL if it is empty. */
+bool mpmc_push (struct mpmc *, void *);
+void *mpmc_pop (struct mpmc *);
+size_t mpmc_push_batch (struct mpmc *, void **, size_t n);
+size_t mpmc_pop_batch (struct mpmc *, void **, size_t max);
+
+#endif /* mpmc.h */
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <time.h>
 #include "threadpool.h"
 #include "threadpool_lib.h"
 
@@ -11,6 +12,7 @@
 #define MAX_LONGS (MAX_N * MAX_N / WORD_BITS)
 
 static int max_parallel_depth = 6;
+static int shutdown_after_ms = -1;
 static int valid_solutions[] = {0, 1, 0, 0, 2, 10, 4, 40, 92, 352, 724, 2680, 14200,
                                 73712, 365596, 2279184, 14772512, 95815104, 666090624};
 
@@ -67,6 +69,9 @@ static int solved(struct board* board, int N) {
 static void* backtrack(struct thread_pool* pool, void* _state) {
     int i;
     struct board_state* state = (struct board_state*)_state;
+    if (thread_pool_is_cancelled(pool)) {
+        return (void*)0;
+    }
     if (state->N == state->row && solved(&state->board, state->N) == state->N) {
         //print_board(&state->board, state->N);
         return (void*)1;
@@ -80,20 +85,34 @@ static void* backtrack(struct thread_pool* pool, void* _state) {
     if (state->row < max_parallel_depth) {
         struct board_state* boards = calloc(sizeof(struct board_state), state->N);
         struct future** futures = calloc(sizeof(struct future*), state->N - 1);
+        void* data[MAX_N];
         long slns = 0;
         for (i = 0; i < state->N; i++) {
             boards[i].N = state->N;
             boards[i].row = state->row + 1;
             memcpy(&boards[i].board, &state->board, sizeof(struct board));
             set_queen(&boards[i].board, state->row, i, state->N);
-            if (i != state->N - 1) {
-                futures[i] = thread_pool_submit(pool, backtrack, &boards[i]);
-            }
+            data[i] = &boards[i];
         }
+        int submitted = thread_pool_submit_batch(pool, state->N - 1, backtrack, data, futures);
         slns += (long)backtrack(pool, &boards[state->N - 1]);
-        for (i = 0; i < state->N - 1; i++) {
-            slns += (long)future_get(futures[i]);
-            future_free(futures[i]);
+        if (submitted == 0) {
+            /* nothing was submitted, so solve the other boards here too */
+            for (i = 0; i < state->N - 1; i++) {
+                slns += (long)backtrack(pool, &boards[i]);
+            }
+        }
+        else {
+            /* wait for all of them at once, then collect the results */
+            struct future* all = future_when_all(futures, state->N - 1);
+            if (all != NULL) {
+                future_get(all);
+                future_free(all);
+            }
+            for (i = 0; i < state->N - 1; i++) {
+                slns += (long)future_get(futures[i]);
+                future_free(futures[i]);
+            }
         }
         free(futures);
         free(boards);
@@ -124,6 +143,23 @@ static void benchmark(int N, int threads) {
     struct benchmark_data* bdata = start_benchmark();
     
     struct future* fut = thread_pool_submit(pool, backtrack, &state);
+
+    if (shutdown_after_ms >= 0) {
+        /* abandon the search and see how long the pool takes to wind down */
+        struct timespec delay = { shutdown_after_ms / 1000, (shutdown_after_ms % 1000) * 1000000L };
+        struct timespec start, end;
+        nanosleep(&delay, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        thread_pool_shutdown_and_destroy(pool);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stop_benchmark(bdata);
+        struct timespec diff = timespec_diff(start, end);
+        printf("Shut down %d ms into the search, took %.3f ms\n", shutdown_after_ms,
+               diff.tv_sec * 1e3 + diff.tv_nsec / 1e6);
+        free(bdata);
+        return;
+    }
+
     long slns = (long)future_get(fut);
 
     stop_benchmark(bdata);
@@ -143,16 +179,17 @@ static void benchmark(int N, int threads) {
 }
 
 static void usage(char *av0, int depth, int nthreads) {
-    fprintf(stderr, "Usage: %s [-d <n>] [-n <n>] [-b] [-q] [-s <n>] <N>\n"
+    fprintf(stderr, "Usage: %s [-d <n>] [-n <n>] [-c <ms>] [-b] [-q] [-s <n>] <N>\n"
                     " -d        parallel recursion depth, default %d\n"
                     " -n        number of threads in pool, default %d\n"
+                    " -c        shut the pool down this many ms into the search\n"
                     , av0, depth, nthreads);
     abort();
 }
 int main(int ac, char** av) {
     int threads = 4;
     int c;
-    while ((c = getopt(ac, av, "d:n:bhs:q")) != EOF) {
+    while ((c = getopt(ac, av, "d:n:c:bhs:q")) != EOF) {
         switch (c) {
         case 'd':
             max_parallel_depth = atoi(optarg);
@@ -160,6 +197,9 @@ int main(int ac, char** av) {
         case 'n':
             threads = atoi(optarg);
             break;
+        case 'c':
+            shutdown_after_ms = atoi(optarg);
+            break;
         case 'h':
             usage(av[0], max_parallel_depth, threads);
         }
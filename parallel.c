@@ -0,0 +1,616 @@
+/* parallel algorithms on top of thread_pool_parallel_for() */
+
+#include "parallel.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* elements per scan block. each block is one unit of work in both passes,
+ * and its sum one entry of the serial scan in between. */
+#define SCAN_BLOCK 8192
+
+/* merges of fewer elements than this are not split any further */
+#define MERGE_SERIAL_THRESHOLD 8192
+
+/* elements per block partitioned by one task in par_partition_int() */
+#define PARTITION_BLOCK 4096
+
+/* radix sort digits, keys per block whose digits one task counts and
+ * scatters, and bytes buffered per digit before they are written out */
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_BLOCK 65536
+#define RADIX_WC_BYTES 64
+
+static inline size_t scan_nblocks(size_t n) {
+    return (n + SCAN_BLOCK - 1) / SCAN_BLOCK;
+}
+
+/* scans for the arithmetic types. each block is summed in the first pass,
+ * and in the second pass scanned starting from the sum of all blocks
+ * before it. the element is read before its output is written, so in
+ * and out may be the same array. */
+#define DEFINE_SCAN(name, type)                                                     \
+struct name##_state {                                                               \
+    const type * in;                                                                \
+    type * out;                                                                     \
+    size_t n;                                                                       \
+    type * sums;                                                                    \
+    enum par_scan_kind kind;                                                        \
+};                                                                                  \
+                                                                                    \
+static void name##_sum_blocks(struct thread_pool * pool, long begin, long end,     \
+                              void * data) {                                        \
+    struct name##_state * s = data;                                                 \
+    long b;                                                                         \
+    for (b = begin; b < end; b++) {                                                 \
+        size_t i = b * SCAN_BLOCK;                                                  \
+        size_t last = i + SCAN_BLOCK < s->n ? i + SCAN_BLOCK : s->n;                \
+        type sum = 0;                                                               \
+        for (; i < last; i++) {                                                     \
+            sum += s->in[i];                                                        \
+        }                                                                           \
+        s->sums[b] = sum;                                                           \
+    }                                                                               \
+}                                                                                   \
+                                                                                    \
+static void name##_scan_blocks(struct thread_pool * pool, long begin, long end,    \
+                               void * data) {                                       \
+    struct name##_state * s = data;                                                 \
+    long b;                                                                         \
+    for (b = begin; b < end; b++) {                                                 \
+        size_t i = b * SCAN_BLOCK;                                                  \
+        size_t last = i + SCAN_BLOCK < s->n ? i + SCAN_BLOCK : s->n;                \
+        type sum = s->sums[b];                                                      \
+        if (s->kind == PAR_SCAN_INCLUSIVE) {                                        \
+            for (; i < last; i++) {                                                 \
+                sum += s->in[i];                                                    \
+                s->out[i] = sum;                                                    \
+            }                                                                       \
+        } else {                                                                    \
+            for (; i < last; i++) {                                                 \
+                type x = s->in[i];                                                  \
+                s->out[i] = sum;                                                    \
+                sum += x;                                                           \
+            }                                                                       \
+        }                                                                           \
+    }                                                                               \
+}                                                                                   \
+                                                                                    \
+void par_##name(struct thread_pool * pool, const type * in, type * out, size_t n,  \
+                enum par_scan_kind kind) {                                          \
+    size_t nblocks = scan_nblocks(n);                                               \
+    struct name##_state s = { in, out, n, NULL, kind };                             \
+    type sum = 0;                                                                   \
+    size_t i;                                                                       \
+                                                                                    \
+    if (nblocks <= 1 || (s.sums = malloc(nblocks * sizeof(type))) == NULL) {        \
+        /* too small to be worth it, or no memory for the block sums */             \
+        for (i = 0; i < n; i++) {                                                   \
+            type x = in[i];                                                         \
+            out[i] = kind == PAR_SCAN_INCLUSIVE ? sum + x : sum;                    \
+            sum += x;                                                               \
+        }                                                                           \
+        return;                                                                     \
+    }                                                                               \
+                                                                                    \
+    thread_pool_parallel_for(pool, 0, nblocks, name##_sum_blocks, &s);              \
+    for (i = 0; i < nblocks; i++) {                                                 \
+        type x = s.sums[i];                                                         \
+        s.sums[i] = sum;                                                            \
+        sum += x;                                                                   \
+    }                                                                               \
+    thread_pool_parallel_for(pool, 0, nblocks, name##_scan_blocks, &s);             \
+    free(s.sums);                                                                   \
+}
+
+DEFINE_SCAN(scan_int64, int64_t)
+DEFINE_SCAN(scan_double, double)
+
+/* a generic par_scan() in progress. the block sums are 'size' bytes apart */
+struct scan_state {
+    const char * in;
+    char * out;
+    size_t n;
+    size_t size;
+    const void * identity;
+    par_scan_op op;
+    void * ctx;
+    enum par_scan_kind kind;
+    char * sums;
+    char * tmp;                 /* one scratch element per block, plus one */
+};
+
+static void scan_sum_blocks(struct thread_pool * pool, long begin, long end, void * data) {
+    struct scan_state * s = data;
+    long b;
+    for (b = begin; b < end; b++) {
+        size_t i = b * SCAN_BLOCK;
+        size_t last = i + SCAN_BLOCK < s->n ? i + SCAN_BLOCK : s->n;
+        char * sum = s->sums + b * s->size;
+        memcpy(sum, s->identity, s->size);
+        for (; i < last; i++) {
+            s->op(sum, sum, s->in + i * s->size, s->ctx);
+        }
+    }
+}
+
+static void scan_scan_blocks(struct thread_pool * pool, long begin, long end, void * data) {
+    struct scan_state * s = data;
+    long b;
+    for (b = begin; b < end; b++) {
+        size_t i = b * SCAN_BLOCK;
+        size_t last = i + SCAN_BLOCK < s->n ? i + SCAN_BLOCK : s->n;
+        char * sum = s->sums + b * s->size;
+        char * x = s->tmp + b * s->size;
+        for (; i < last; i++) {
+            char * o = s->out + i * s->size;
+            if (s->kind == PAR_SCAN_INCLUSIVE) {
+                s->op(sum, sum, s->in + i * s->size, s->ctx);
+                memcpy(o, sum, s->size);
+            } else {
+                memcpy(x, s->in + i * s->size, s->size);
+                memcpy(o, sum, s->size);
+                s->op(sum, sum, x, s->ctx);
+            }
+        }
+    }
+}
+
+/* generic two-pass blocked scan */
+bool par_scan(struct thread_pool * pool, const void * in, void * out, size_t n, size_t size,
+              const void * identity, par_scan_op op, void * ctx, enum par_scan_kind kind) {
+    size_t nblocks = scan_nblocks(n);
+    struct scan_state s = { in, out, n, size, identity, op, ctx, kind, NULL, NULL };
+    size_t b;
+
+    if (n == 0) {
+        return true;
+    }
+    if ((s.sums = malloc((2 * nblocks + 1) * size)) == NULL) {
+        printf("Error allocating block sums.\n");
+        return false;
+    }
+    s.tmp = s.sums + nblocks * size;
+
+    thread_pool_parallel_for(pool, 0, nblocks, scan_sum_blocks, &s);
+
+    /* exclusive scan of the block sums, the running total in tmp[0] and
+     * the old block sum in tmp[1] */
+    memcpy(s.tmp, identity, size);
+    for (b = 0; b < nblocks; b++) {
+        char * sum = s.sums + b * size;
+        memcpy(s.tmp + size, sum, size);
+        memcpy(sum, s.tmp, size);
+        op(s.tmp, s.tmp, s.tmp + size, ctx);
+    }
+
+    thread_pool_parallel_for(pool, 0, nblocks, scan_scan_blocks, &s);
+    free(s.sums);
+    return true;
+}
+
+/* a piece of a par_merge(). cmp is NULL for ints, which are compared inline */
+struct merge_task {
+    const char * a;
+    size_t na;
+    const char * b;
+    size_t nb;
+    char * out;
+    size_t size;
+    int (* cmp)(const void *, const void *);
+};
+
+static inline bool merge_less(struct merge_task * t, const char * x, const char * y) {
+    if (t->cmp == NULL) {
+        return *(const int *) x < *(const int *) y;
+    }
+    return t->cmp(x, y) < 0;
+}
+
+/* number of elements of s, n elements long, that go before x: those less
+ * than x, or if 'ties' also those equal to x */
+static size_t merge_rank(struct merge_task * t, const char * s, size_t n, const char * x, bool ties) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const char * e = s + mid * t->size;
+        if (ties ? !merge_less(t, x, e) : merge_less(t, e, x)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void merge_serial(struct merge_task * t) {
+    if (t->cmp == NULL) {
+        const int * a = (const int *) t->a, * b = (const int *) t->b;
+        const int * aend = a + t->na, * bend = b + t->nb;
+        int * out = (int *) t->out;
+        while (a < aend && b < bend) {
+            *out++ = *b < *a ? *b++ : *a++;
+        }
+        memcpy(out, a, (aend - a) * sizeof(int));
+        memcpy(out + (aend - a), b, (bend - b) * sizeof(int));
+        return;
+    }
+
+    size_t i = 0, j = 0;
+    char * out = t->out;
+    while (i < t->na && j < t->nb) {
+        const char * x = t->a + i * t->size, * y = t->b + j * t->size;
+        if (merge_less(t, y, x)) {
+            memcpy(out, y, t->size);
+            j++;
+        } else {
+            memcpy(out, x, t->size);
+            i++;
+        }
+        out += t->size;
+    }
+    memcpy(out, t->a + i * t->size, (t->na - i) * t->size);
+    out += (t->na - i) * t->size;
+    memcpy(out, t->b + j * t->size, (t->nb - j) * t->size);
+}
+
+/* split at the middle element of the larger input. everything in a that
+ * is not after it and everything in b that is before it goes left, so
+ * ties keep a's elements first. */
+static void * merge_parallel(struct thread_pool * pool, void * data) {
+    struct merge_task * t = data;
+
+    if (t->na + t->nb <= MERGE_SERIAL_THRESHOLD) {
+        merge_serial(t);
+        return NULL;
+    }
+
+    size_t ma, mb;
+    if (t->na >= t->nb) {
+        ma = t->na / 2;
+        mb = merge_rank(t, t->b, t->nb, t->a + ma * t->size, false);
+    } else {
+        mb = t->nb / 2;
+        ma = merge_rank(t, t->a, t->na, t->b + mb * t->size, true);
+    }
+
+    struct merge_task right = {
+        t->a + ma * t->size, t->na - ma,
+        t->b + mb * t->size, t->nb - mb,
+        t->out + (ma + mb) * t->size, t->size, t->cmp
+    };
+    struct future_storage storage;
+    struct future * f = thread_pool_submit_into(pool, &storage, merge_parallel, &right);
+    if (f == NULL) {
+        merge_parallel(pool, &right);
+    }
+
+    struct merge_task left = { t->a, ma, t->b, mb, t->out, t->size, t->cmp };
+    merge_parallel(pool, &left);
+    if (f != NULL) {
+        future_get(f);
+    }
+    return NULL;
+}
+
+/* runs the whole merge as one task, so that callers outside the pool get
+ * workers to do it */
+static void merge_run(struct thread_pool * pool, struct merge_task * t) {
+    struct future_storage storage;
+    struct future * f = thread_pool_submit_into(pool, &storage, merge_parallel, t);
+    if (f == NULL) {
+        merge_parallel(pool, t);
+        return;
+    }
+    future_get(f);
+}
+
+void par_merge_int(struct thread_pool * pool, const int * a, size_t na,
+                   const int * b, size_t nb, int * out) {
+    struct merge_task t = { (const char *) a, na, (const char *) b, nb, (char *) out, sizeof(int), NULL };
+    merge_run(pool, &t);
+}
+
+void par_merge(struct thread_pool * pool, const void * a, size_t na, const void * b, size_t nb,
+               void * out, size_t size, int (* cmp)(const void *, const void *)) {
+    struct merge_task t = { a, na, b, nb, out, size, cmp };
+    merge_run(pool, &t);
+}
+
+/* a run of elements on the wrong side of the partition boundary. 'offset'
+ * is the number of misplaced elements in the runs before it. */
+struct partition_run {
+    size_t start;
+    size_t len;
+    size_t offset;
+};
+
+/* a par_partition_int() in progress */
+struct partition_state {
+    int * a;
+    size_t n;
+    int pivot;
+    size_t * nless;                 /* per block, elements less than pivot */
+    struct partition_run * left;    /* elements >= pivot before the boundary */
+    struct partition_run * right;   /* elements < pivot after it */
+    size_t nleft;
+    size_t nright;
+};
+
+/* two-pointer partition of a[lo..hi), returns the number of elements less than pivot */
+static size_t partition_serial(int * a, size_t lo, size_t hi, int pivot) {
+    size_t i = lo, j = hi;
+    for (;;) {
+        while (i < j && a[i] < pivot) {
+            i++;
+        }
+        while (i < j && !(a[j - 1] < pivot)) {
+            j--;
+        }
+        if (i >= j) {
+            return i - lo;
+        }
+        int t = a[i];
+        a[i] = a[j - 1];
+        a[j - 1] = t;
+    }
+}
+
+static void partition_blocks(struct thread_pool * pool, long begin, long end, void * data) {
+    struct partition_state * s = data;
+    long b;
+    for (b = begin; b < end; b++) {
+        size_t lo = b * PARTITION_BLOCK;
+        size_t hi = lo + PARTITION_BLOCK < s->n ? lo + PARTITION_BLOCK : s->n;
+        s->nless[b] = partition_serial(s->a, lo, hi, s->pivot);
+    }
+}
+
+/* the run containing misplaced element number 'i' */
+static struct partition_run * partition_find(struct partition_run * runs, size_t n, size_t i) {
+    size_t lo = 0, hi = n;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (runs[mid].offset <= i) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return &runs[lo];
+}
+
+/* swap misplaced elements begin..end-1 on the left with as many on the right */
+static void partition_swap(struct thread_pool * pool, long begin, long end, void * data) {
+    struct partition_state * s = data;
+    struct partition_run * l = partition_find(s->left, s->nleft, begin);
+    struct partition_run * r = partition_find(s->right, s->nright, begin);
+    size_t li = l->start + (begin - l->offset);
+    size_t ri = r->start + (begin - r->offset);
+    long i;
+
+    for (i = begin; i < end; i++) {
+        if (li == l->start + l->len) {
+            l++;
+            li = l->start;
+        }
+        if (ri == r->start + r->len) {
+            r++;
+            ri = r->start;
+        }
+        int t = s->a[li];
+        s->a[li++] = s->a[ri];
+        s->a[ri++] = t;
+    }
+}
+
+/* block-wise parallel partition. after every block is partitioned on its
+ * own, the blocks' elements >= pivot that lie before the final boundary
+ * are exactly as many as their elements < pivot that lie after it. they
+ * are numbered in order on both sides, and the i-th ones swapped. */
+size_t par_partition_int(struct thread_pool * pool, int * a, size_t n, int pivot) {
+    size_t nblocks = (n + PARTITION_BLOCK - 1) / PARTITION_BLOCK;
+    struct partition_state s = { a, n, pivot };
+    size_t b, k = 0;
+
+    if (nblocks <= 1) {
+        return partition_serial(a, 0, n, pivot);
+    }
+    s.nless = malloc(nblocks * (sizeof(size_t) + 2 * sizeof(struct partition_run)));
+    if (s.nless == NULL) {
+        printf("Error allocating partition blocks, partitioning serially.\n");
+        return partition_serial(a, 0, n, pivot);
+    }
+    s.left = (struct partition_run *) (s.nless + nblocks);
+    s.right = s.left + nblocks;
+
+    thread_pool_parallel_for(pool, 0, nblocks, partition_blocks, &s);
+
+    for (b = 0; b < nblocks; b++) {
+        k += s.nless[b];
+    }
+
+    size_t nmisplaced = 0, nright = 0;
+    s.nleft = s.nright = 0;
+    for (b = 0; b < nblocks; b++) {
+        size_t lo = b * PARTITION_BLOCK;
+        size_t mid = lo + s.nless[b];
+        size_t hi = lo + PARTITION_BLOCK < n ? lo + PARTITION_BLOCK : n;
+
+        if (mid < k && mid < hi) {
+            size_t len = (hi < k ? hi : k) - mid;
+            s.left[s.nleft++] = (struct partition_run) { mid, len, nmisplaced };
+            nmisplaced += len;
+        }
+        if (lo < k) {
+            lo = k;
+        }
+        if (lo < mid) {
+            s.right[s.nright++] = (struct partition_run) { lo, mid - lo, nright };
+            nright += mid - lo;
+        }
+    }
+
+    thread_pool_parallel_for(pool, 0, nmisplaced, partition_swap, &s);
+    free(s.nless);
+    return k;
+}
+
+/* a parallel copy of 'size'-byte elements */
+struct copy_state {
+    char * dst;
+    const char * src;
+    size_t size;
+};
+
+static void copy_range(struct thread_pool * pool, long begin, long end, void * data) {
+    struct copy_state * c = data;
+    memcpy(c->dst + begin * c->size, c->src + begin * c->size, (end - begin) * c->size);
+}
+
+/* one pass of a radix sort in progress. offsets is digit-major, so that
+ * an exclusive scan over it gives each block the position of its first
+ * key with each digit. */
+struct radix_state {
+    const void * src;
+    void * dst;
+    size_t n;
+    size_t nblocks;
+    int shift;
+    int64_t * offsets;              /* offsets[digit * nblocks + block] */
+};
+
+/* counting and scattering for one key type. keys are staged in a cache
+ * line sized buffer per digit, so the scatter writes whole lines to 256
+ * places instead of single keys. each digit's first flush only fills up
+ * the output line it starts in, so that every later one covers exactly
+ * one line. */
+#define DEFINE_RADIX(name, type)                                                    \
+static void name##_count(struct thread_pool * pool, long begin, long end,          \
+                         void * data) {                                             \
+    struct radix_state * s = data;                                                  \
+    const type * src = s->src;                                                      \
+    long b;                                                                         \
+    for (b = begin; b < end; b++) {                                                 \
+        size_t count[RADIX_BUCKETS] = { 0 };                                        \
+        size_t i = b * RADIX_BLOCK;                                                 \
+        size_t last = i + RADIX_BLOCK < s->n ? i + RADIX_BLOCK : s->n;              \
+        int d;                                                                      \
+        for (; i < last; i++) {                                                     \
+            count[(src[i] >> s->shift) & (RADIX_BUCKETS - 1)]++;                    \
+        }                                                                           \
+        for (d = 0; d < RADIX_BUCKETS; d++) {                                       \
+            s->offsets[d * s->nblocks + b] = count[d];                              \
+        }                                                                           \
+    }                                                                               \
+}                                                                                   \
+                                                                                    \
+static void name##_scatter(struct thread_pool * pool, long begin, long end,        \
+                           void * data) {                                           \
+    enum { WC = RADIX_WC_BYTES / sizeof(type) };                                    \
+    struct radix_state * s = data;                                                  \
+    const type * src = s->src;                                                      \
+    type * dst = s->dst;                                                            \
+    _Alignas(64) type buf[RADIX_BUCKETS][WC];                                       \
+    size_t pos[RADIX_BUCKETS];                                                      \
+    unsigned fill[RADIX_BUCKETS];                                                   \
+    unsigned limit[RADIX_BUCKETS];  /* keys to buffer before the next flush */      \
+    long b;                                                                         \
+    for (b = begin; b < end; b++) {                                                 \
+        size_t i = b * RADIX_BLOCK;                                                 \
+        size_t last = i + RADIX_BLOCK < s->n ? i + RADIX_BLOCK : s->n;              \
+        int d;                                                                      \
+        for (d = 0; d < RADIX_BUCKETS; d++) {                                       \
+            pos[d] = s->offsets[d * s->nblocks + b];                                \
+            fill[d] = 0;                                                            \
+            limit[d] = WC - (uintptr_t) (dst + pos[d]) / sizeof(type) % WC;         \
+        }                                                                           \
+        for (; i < last; i++) {                                                     \
+            type k = src[i];                                                        \
+            d = (k >> s->shift) & (RADIX_BUCKETS - 1);                              \
+            buf[d][fill[d]++] = k;                                                  \
+            if (fill[d] == WC) {                                                    \
+                memcpy(dst + pos[d], buf[d], sizeof buf[d]);                        \
+                pos[d] += WC;                                                       \
+                fill[d] = 0;                                                        \
+            } else if (fill[d] == limit[d]) {                                       \
+                /* the head of the digit's output, up to a line boundary */         \
+                memcpy(dst + pos[d], buf[d], fill[d] * sizeof(type));               \
+                pos[d] += fill[d];                                                  \
+                fill[d] = 0;                                                        \
+                limit[d] = WC;                                                      \
+            }                                                                       \
+        }                                                                           \
+        for (d = 0; d < RADIX_BUCKETS; d++) {                                       \
+            memcpy(dst + pos[d], buf[d], fill[d] * sizeof(type));                   \
+        }                                                                           \
+    }                                                                               \
+}                                                                                   \
+                                                                                    \
+bool par_radix_sort_##name(struct thread_pool * pool, type * a, size_t n) {         \
+    return radix_sort(pool, a, n, sizeof(type), name##_count, name##_scatter);      \
+}
+
+/* true if every key has the same digit, counted in s->offsets */
+static bool radix_one_digit(struct radix_state * s) {
+    int d;
+    for (d = 0; d < RADIX_BUCKETS; d++) {
+        size_t total = 0, b;
+        for (b = 0; b < s->nblocks; b++) {
+            total += s->offsets[d * s->nblocks + b];
+        }
+        if (total != 0) {
+            return total == s->n;
+        }
+    }
+    return true;
+}
+
+/* LSD radix sort, ping-ponging between a and a scratch array */
+static bool radix_sort(struct thread_pool * pool, void * a, size_t n, size_t size,
+                       thread_pool_range_fn count, thread_pool_range_fn scatter) {
+    struct radix_state s;
+    void * tmp;
+
+    s.n = n;
+    s.nblocks = (n + RADIX_BLOCK - 1) / RADIX_BLOCK;
+    if (n <= 1) {
+        return true;
+    }
+    tmp = malloc(n * size);
+    s.offsets = malloc(s.nblocks * RADIX_BUCKETS * sizeof(int64_t));
+    if (tmp == NULL || s.offsets == NULL) {
+        printf("Error allocating radix sort scratch space.\n");
+        free(tmp);
+        free(s.offsets);
+        return false;
+    }
+
+    s.src = a;
+    s.dst = tmp;
+    for (s.shift = 0; s.shift < (int) size * 8; s.shift += RADIX_BITS) {
+        thread_pool_parallel_for(pool, 0, s.nblocks, count, &s);
+        if (radix_one_digit(&s)) {
+            continue;
+        }
+        par_scan_int64(pool, s.offsets, s.offsets, s.nblocks * RADIX_BUCKETS, PAR_SCAN_EXCLUSIVE);
+        thread_pool_parallel_for(pool, 0, s.nblocks, scatter, &s);
+
+        const void * t = s.src;
+        s.src = s.dst;
+        s.dst = (void *) t;
+    }
+
+    if (s.src != a) {
+        struct copy_state c = { a, s.src, size };
+        thread_pool_parallel_for(pool, 0, n, copy_range, &c);
+    }
+    free(tmp);
+    free(s.offsets);
+    return true;
+}
+
+DEFINE_RADIX(u32, uint32_t)
+DEFINE_RADIX(u64, uint64_t)
@@ -0,0 +1,95 @@
+/**
+ * parallel.h
+ *
+ * Parallel algorithms built on the fork-join thread pool.
+ */
+#ifndef __PARALLEL_H
+#define __PARALLEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "threadpool.h"
+
+/* Whether element i of a scan's output includes in[i]. */
+enum par_scan_kind {
+    PAR_SCAN_EXCLUSIVE,         /* out[i] = in[0] + ... + in[i-1] */
+    PAR_SCAN_INCLUSIVE          /* out[i] = in[0] + ... + in[i] */
+};
+
+/*
+ * Prefix sums of the 'n' elements of 'in', stored in 'out'.
+ * 'in' and 'out' may be the same array.  The array is cut into
+ * blocks; the first pass sums every block in parallel, the block
+ * sums are scanned serially, and the second pass scans every block
+ * in parallel starting from its block's offset.
+ *
+ * May be called from inside a task or from outside the pool.
+ */
+void par_scan_int64(struct thread_pool *pool, const int64_t *in, int64_t *out,
+        size_t n, enum par_scan_kind kind);
+void par_scan_double(struct thread_pool *pool, const double *in, double *out,
+        size_t n, enum par_scan_kind kind);
+
+/* An associative operation for par_scan(): dst = a op b.  'dst'
+ * may be the same as 'a'. */
+typedef void (* par_scan_op) (void *dst, const void *a, const void *b, void *ctx);
+
+/*
+ * Like par_scan_int64(), for elements of 'size' bytes combined with
+ * 'op', whose neutral element is 'identity'.  'op' need not be
+ * commutative.
+ *
+ * Returns false if the block sums could not be allocated.
+ */
+bool par_scan(struct thread_pool *pool, const void *in, void *out,
+        size_t n, size_t size, const void *identity,
+        par_scan_op op, void *ctx, enum par_scan_kind kind);
+
+/*
+ * Merge the sorted arrays 'a' of 'na' elements and 'b' of 'nb'
+ * elements into 'out', which must not overlap either of them.
+ * The merge is stable: elements of 'a' come before equal elements
+ * of 'b'.  Large merges are split by binary-searching for the
+ * position of the larger input's middle element in the smaller
+ * one, and the two halves are merged in parallel.
+ *
+ * May be called from inside a task or from outside the pool.
+ */
+void par_merge_int(struct thread_pool *pool, const int *a, size_t na,
+        const int *b, size_t nb, int *out);
+
+/* Like par_merge_int(), for elements of 'size' bytes ordered by
+ * 'cmp' as in qsort(). */
+void par_merge(struct thread_pool *pool, const void *a, size_t na,
+        const void *b, size_t nb, void *out, size_t size,
+        int (*cmp)(const void *, const void *));
+
+/*
+ * Reorder the 'n' elements of 'a' so that those less than 'pivot'
+ * come first, and return how many there are.  The array is cut
+ * into blocks that are partitioned in parallel; then the elements
+ * that ended up on the wrong side of the boundary between the two
+ * classes are swapped across it in parallel.  Not stable.
+ *
+ * May be called from inside a task or from outside the pool.
+ */
+size_t par_partition_int(struct thread_pool *pool, int *a, size_t n, int pivot);
+
+/*
+ * Sort the 'n' keys of 'a' in ascending order with an LSD radix
+ * sort, one pass per byte of the key.  Every pass counts digits per
+ * block of keys in parallel, turns the counts into output offsets
+ * with par_scan_int64(), and scatters the blocks in parallel
+ * through per-digit write-combining buffers, which are flushed to
+ * whole output cache lines.  Passes in which all keys have the
+ * same digit are skipped.
+ *
+ * May be called from inside a task or from outside the pool.
+ * Returns false if the scratch space could not be allocated.
+ */
+bool par_radix_sort_u32(struct thread_pool *pool, uint32_t *a, size_t n);
+bool par_radix_sort_u64(struct thread_pool *pool, uint64_t *a, size_t n);
+
+#endif /* parallel.h */
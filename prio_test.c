@@ -0,0 +1,210 @@
+/*
+ * Fork/Join Framework
+ *
+ * Priority test.
+ *
+ * Queues a flood of low priority background tasks, then short
+ * normal and high priority tasks behind them, and reports how long
+ * the tasks of each priority waited in the queues.  With a single
+ * worker, checks that the tasks started in priority order.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "threadpool.h"
+#include "threadpool_lib.h"
+#define DEFAULT_THREADS 1
+#define DEFAULT_BACKGROUND 2000
+#define DEFAULT_URGENT 200
+#define DEFAULT_WORK_US 20
+
+static const char *prio_name[THREAD_POOL_NUM_PRIOS] = { "high", "normal", "low" };
+
+static int work_us = DEFAULT_WORK_US;
+
+/* order in which tasks started */
+static atomic_long started;
+
+/* holds every worker until all tasks are queued */
+static atomic_int nblocked;
+static atomic_bool release;
+
+struct task {
+    enum thread_pool_priority prio;
+    long start;
+};
+
+static void
+busy_wait(int us)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 < us);
+}
+
+static void *
+blocker_task(struct thread_pool *pool, void * data)
+{
+    atomic_fetch_add(&nblocked, 1);
+    while (!atomic_load(&release))
+        sched_yield();
+    return NULL;
+}
+
+static void *
+work_task(struct thread_pool *pool, struct task * t)
+{
+    t->start = atomic_fetch_add(&started, 1);
+    busy_wait(work_us);
+    return t;
+}
+
+static int
+run_test(int nthreads, int nbackground, int nurgent)
+{
+    struct thread_pool_options opts;
+    thread_pool_options_init(&opts, nthreads);
+    opts.record_latency = true;
+
+    struct benchmark_data * bdata = start_benchmark();
+    struct thread_pool * threadpool = thread_pool_new_with_options(&opts);
+
+    /* occupy every worker, so that everything below is queued before
+     * the first of it runs */
+    struct future **blockers = malloc(sizeof(*blockers) * nthreads);
+    int i;
+    for (i = 0; i < nthreads; i++)
+        blockers[i] = thread_pool_submit_prio(threadpool, THREAD_POOL_PRIO_LOW,
+                                              blocker_task, NULL);
+    while (atomic_load(&nblocked) < nthreads)
+        sched_yield();
+
+    int ntasks = nbackground + 2 * nurgent;
+    struct task *tasks = malloc(sizeof(*tasks) * ntasks);
+    struct future **f = malloc(sizeof(*f) * ntasks);
+    for (i = 0; i < ntasks; i++) {
+        if (i < nbackground)
+            tasks[i].prio = THREAD_POOL_PRIO_LOW;
+        else if ((i - nbackground) % 2 == 0)
+            tasks[i].prio = THREAD_POOL_PRIO_NORMAL;
+        else
+            tasks[i].prio = THREAD_POOL_PRIO_HIGH;
+        f[i] = thread_pool_submit_prio(threadpool, tasks[i].prio,
+                                       (fork_join_task_t) work_task, &tasks[i]);
+    }
+    atomic_store(&release, true);
+
+    bool success = true;
+    for (i = 0; i < ntasks; i++) {
+        if (future_get(f[i]) != &tasks[i])
+            success = false;
+        future_free(f[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        future_get(blockers[i]);
+        future_free(blockers[i]);
+    }
+
+    /* a single worker must have run every high priority task before
+     * any normal one, and every normal one before any low one */
+    if (nthreads == 1) {
+        long first[THREAD_POOL_NUM_PRIOS], last[THREAD_POOL_NUM_PRIOS];
+        int p;
+        for (p = 0; p < THREAD_POOL_NUM_PRIOS; p++) {
+            first[p] = ntasks;
+            last[p] = -1;
+        }
+        for (i = 0; i < ntasks; i++) {
+            p = tasks[i].prio;
+            if (tasks[i].start < first[p])
+                first[p] = tasks[i].start;
+            if (tasks[i].start > last[p])
+                last[p] = tasks[i].start;
+        }
+        for (p = 1; p < THREAD_POOL_NUM_PRIOS; p++) {
+            if (last[p - 1] >= 0 && first[p] < ntasks && last[p - 1] > first[p]) {
+                fprintf(stderr, "A %s priority task started before a %s priority one\n",
+                        prio_name[p], prio_name[p - 1]);
+                success = false;
+            }
+        }
+    }
+
+    int p;
+    for (p = 0; p < THREAD_POOL_NUM_PRIOS; p++) {
+        struct thread_pool_latency lat;
+        thread_pool_get_latency_stats(threadpool, p, &lat);
+        printf("%-6s %6lu tasks, queue wait mean %9.3f ms, p50 <= %9.3f ms, p99 <= %9.3f ms, max %9.3f ms\n",
+               prio_name[p], lat.count, lat.mean_ns / 1e6, lat.p50_ns / 1e6,
+               lat.p99_ns / 1e6, lat.max_ns / 1e6);
+    }
+    thread_pool_shutdown_and_destroy(threadpool);
+
+    stop_benchmark(bdata);
+
+    // consistency check
+    if (!success) {
+        fprintf(stderr, "Wrong result\n");
+        abort();
+    }
+
+    report_benchmark_results(bdata);
+    printf("Test successful.\n");
+    free(bdata);
+    free(tasks);
+    free(f);
+    free(blockers);
+    return 0;
+}
+
+/**********************************************************************************/
+
+static void
+usage(char *av0, int exvalue)
+{
+    fprintf(stderr, "Usage: %s [-n <n>] [-b <n>] [-u <n>] [-w <us>]\n"
+                    " -n number of threads in pool, default %d\n"
+                    " -b number of low priority background tasks, default %d\n"
+                    " -u number of normal and of high priority tasks, default %d\n"
+                    " -w microseconds each task runs, default %d\n"
+                    , av0, DEFAULT_THREADS, DEFAULT_BACKGROUND, DEFAULT_URGENT, DEFAULT_WORK_US);
+    exit(exvalue);
+}
+
+int
+main(int ac, char *av[])
+{
+    int c, nthreads = DEFAULT_THREADS;
+    int nbackground = DEFAULT_BACKGROUND, nurgent = DEFAULT_URGENT;
+    while ((c = getopt(ac, av, "n:b:u:w:h")) != EOF) {
+        switch (c) {
+        case 'n':
+            nthreads = atoi(optarg);
+            break;
+        case 'b':
+            nbackground = atoi(optarg);
+            break;
+        case 'u':
+            nurgent = atoi(optarg);
+            break;
+        case 'w':
+            work_us = atoi(optarg);
+            break;
+        case 'h':
+            usage(av[0], EXIT_SUCCESS);
+        default:
+            usage(av[0], EXIT_FAILURE);
+        }
+    }
+
+    return run_test(nthreads, nbackground, nurgent);
+}
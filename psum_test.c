@@ -11,6 +11,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -53,9 +55,52 @@ parallel_sum(struct thread_pool * pool, void * _data)
     return (void *)(lresult + rresult);
 }
 
+/* Sum of a loop run with thread_pool_parallel_for(). */
+struct for_sum {
+    int *v;
+    atomic_ullong sum;
+};
+
+static void
+sum_range(struct thread_pool * pool, long beg, long end, void * _data)
+{
+    struct for_sum * s = _data;
+    unsigned long long sum = 0;
+    long i;
+    for (i = beg; i < end; i++)
+        sum += s->v[i];
+    atomic_fetch_add_explicit(&s->sum, sum, memory_order_relaxed);
+}
+
+/* Callbacks to sum with thread_pool_parallel_reduce(). */
+static void
+sum_identity(void * acc, void * ctx)
+{
+    *(unsigned long long *) acc = 0;
+}
+
+static void
+sum_leaf(struct thread_pool * pool, long beg, long end, void * acc, void * ctx)
+{
+    int * v = ctx;
+    unsigned long long sum = *(unsigned long long *) acc;
+    long i;
+    for (i = beg; i < end; i++)
+        sum += v[i];
+    *(unsigned long long *) acc = sum;
+}
+
+static void
+sum_combine(void * dst, const void * src, void * ctx)
+{
+    *(unsigned long long *) dst += *(const unsigned long long *) src;
+}
+
 static void usage(char *av0, int nthreads) {
-    fprintf(stderr, "Usage: %s [-n <n>] <N>\n"
+    fprintf(stderr, "Usage: %s [-n <n>] [-f|-r] <N>\n"
                     " -n        number of threads in pool, default %d\n"
+                    " -f        sum with thread_pool_parallel_for instead of recursive tasks\n"
+                    " -r        sum with thread_pool_parallel_reduce instead of recursive tasks\n"
                     , av0, nthreads);
     exit(0);
 }
@@ -64,17 +109,24 @@ int
 main(int ac, char *av[])
 {
     int nthreads = 4;
+    bool use_for = false, use_reduce = false;
     int c;
-    while ((c = getopt(ac, av, "n:h")) != EOF) {
+    while ((c = getopt(ac, av, "n:frh")) != EOF) {
         switch (c) {
         case 'n':
             nthreads = atoi(optarg);
             break;
+        case 'f':
+            use_for = true;
+            break;
+        case 'r':
+            use_reduce = true;
+            break;
         case 'h':
             usage(av[0], nthreads);
         }
     }
-    if (optind == ac)
+    if (optind == ac || (use_for && use_reduce))
         usage(av[0], nthreads);
 
     int len = atoi(av[optind]);
@@ -94,10 +146,24 @@ main(int ac, char *av[])
 
     printf("starting...\n");
     struct benchmark_data* bdata = start_benchmark();
-    struct future *f = thread_pool_submit(pool, parallel_sum, &roottask);
-    unsigned long long sum = (unsigned long long) future_get(f);
-    stop_benchmark(bdata);
-    future_free(f);
+    unsigned long long sum;
+    if (use_reduce) {
+        if (!thread_pool_parallel_reduce(pool, 0, len, sizeof sum,
+                sum_identity, sum_leaf, sum_combine, &sum, v))
+            abort();
+        stop_benchmark(bdata);
+    } else if (use_for) {
+        struct for_sum s = { .v = v };
+        atomic_init(&s.sum, 0);
+        thread_pool_parallel_for(pool, 0, len, sum_range, &s);
+        sum = atomic_load(&s.sum);
+        stop_benchmark(bdata);
+    } else {
+        struct future *f = thread_pool_submit(pool, parallel_sum, &roottask);
+        sum = (unsigned long long) future_get(f);
+        stop_benchmark(bdata);
+        future_free(f);
+    }
 
     if (sum != realsum) {
         printf("result %lld should be %lld\n", sum, realsum);
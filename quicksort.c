@@ -17,11 +17,14 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <assert.h>
 #include <getopt.h>
 
 #include "threadpool_lib.h"
 #include "threadpool.h"
+#include "parallel.h"
 
 typedef void (*sort_func)(int *, int);
 
@@ -86,6 +89,22 @@ qsort_partition(int * array, int left, int right)
     return last;
 }
 
+/* Partitioning with par_partition_int, same split as qsort_partition */
+static int
+qsort_partition_parallel(struct thread_pool * threadpool, int * array, int left, int right)
+{
+    int middle = left + (right-left)/2;
+
+    // left <=> middle
+    swap(array + left, array + middle);
+
+    int last = left + par_partition_int(threadpool, array + left + 1, right - left, array[left]);
+
+    // left <=> last
+    swap(array + left, array + last);
+    return last;
+}
+
 /* ------------------------------------------------------------- 
  * Serial implementation.
  */
@@ -116,6 +135,21 @@ struct qsort_task {
     int left, right, depth;
 }; 
 
+/* When to partition with par_partition_int instead of serially */
+#define PARALLEL_PARTITION_THRESHOLD 1000000
+static int parallel_partition_threshold = PARALLEL_PARTITION_THRESHOLD;
+
+/* Time spent partitioning and in serial recursion, summed over all tasks */
+static atomic_ulong partition_ns, recursion_ns;
+
+static unsigned long
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
 /* Parallel qsort - returns size of segment sorted */
 static int  
 qsort_internal_parallel(struct thread_pool * threadpool, struct qsort_task * s)
@@ -128,10 +162,19 @@ qsort_internal_parallel(struct thread_pool * threadpool, struct qsort_task * s)
     if (left >= right)
         return 0;
 
-    int split = qsort_partition(array, left, right);
+    unsigned long start = now_ns();
+    int split;
+    if (right - left + 1 >= parallel_partition_threshold)
+        split = qsort_partition_parallel(threadpool, array, left, right);
+    else
+        split = qsort_partition(array, left, right);
+    atomic_fetch_add(&partition_ns, now_ns() - start);
+
     if (depth < 1) {
+        start = now_ns();
         qsort_internal_serial(array, left, split - 1);
         qsort_internal_serial(array, split + 1, right);
+        atomic_fetch_add(&recursion_ns, now_ns() - start);
     } else {
         struct qsort_task qleft = {
             .left = s->left,
@@ -139,7 +182,8 @@ qsort_internal_parallel(struct thread_pool * threadpool, struct qsort_task * s)
             .depth = s->depth-1,
             .array = s->array
         };
-        struct future * lhalf = thread_pool_submit(threadpool, 
+        struct future_storage lstorage;
+        struct future * lhalf = thread_pool_submit_into(threadpool, &lstorage,
                                    (fork_join_task_t) qsort_internal_parallel,  
                                    &qleft);
         struct qsort_task qright = {
@@ -150,7 +194,6 @@ qsort_internal_parallel(struct thread_pool * threadpool, struct qsort_task * s)
         };
         qsort_internal_parallel(threadpool, &qright);
         future_get(lhalf);
-        future_free(lhalf);
     }
     return right - left;
 }
@@ -166,8 +209,12 @@ qsort_parallel(int *array, int N)
     };
 
     struct thread_pool * threadpool = thread_pool_new(nthreads);
+    atomic_store(&partition_ns, 0);
+    atomic_store(&recursion_ns, 0);
     qsort_internal_parallel(threadpool, &root);
     thread_pool_shutdown_and_destroy(threadpool);
+    printf("Time summed over tasks: partition %.3fs, serial recursion %.3fs\n",
+        atomic_load(&partition_ns) / 1e9, atomic_load(&recursion_ns) / 1e9);
 }
 
 /*
@@ -207,13 +254,14 @@ benchmark(const char *benchmark_name, sort_func sorter, int *a0, int N, bool rep
 static void
 usage(char *av0, int depth)
 {
-    fprintf(stderr, "Usage: %s [-d <n>] [-n <n>] [-b] [-q] [-s <n>] <N>\n"
+    fprintf(stderr, "Usage: %s [-d <n>] [-n <n>] [-P <n>] [-b] [-q] [-s <n>] <N>\n"
                     " -d        parallel recursion depth, default %d\n"
+                    " -P        minimum size of a range before partitioning in parallel, default %d\n"
                     " -n        number of threads in pool, default %d\n"
                     " -b        run built-in qsort\n"
                     " -s        specify srand() seed\n"
                     " -q        run serial qsort\n"
-                    , av0, depth, DEFAULT_THREADS);
+                    , av0, depth, PARALLEL_PARTITION_THRESHOLD, DEFAULT_THREADS);
     exit(0);
 }
 
@@ -224,7 +272,7 @@ main(int ac, char *av[])
     bool run_builtin_qsort = false;
     bool run_serial_qsort = false;
 
-    while ((c = getopt(ac, av, "d:n:bhs:q")) != EOF) {
+    while ((c = getopt(ac, av, "d:n:P:bhs:q")) != EOF) {
         switch (c) {
         case 'd':
             depth = atoi(optarg);
@@ -232,6 +280,9 @@ main(int ac, char *av[])
         case 'n':
             nthreads = atoi(optarg);
             break;
+        case 'P':
+            parallel_partition_threshold = atoi(optarg);
+            break;
         case 's':
             srand(atoi(optarg));
             break;
@@ -260,7 +311,8 @@ main(int ac, char *av[])
     if (run_serial_qsort)
         benchmark("qsort serial", qsort_serial, a0, N, false);
 
-    printf("Using %d threads, recursive parallel depth=%d\n", nthreads, depth);
+    printf("Using %d threads, recursive parallel depth=%d parallel partition threshold=%d\n",
+        nthreads, depth, parallel_partition_threshold);
     benchmark("qsort parallel", qsort_parallel, a0, N, true);
 
     return 0;
@@ -0,0 +1,271 @@
+/*
+ * Parallel Radix Sort.
+ *
+ * Benchmark for par_radix_sort_u32/par_radix_sort_u64, with the same
+ * command line and reporting as mergesort.
+ *
+ * Requires threadpool.c/threadpool.h and parallel.c/parallel.h
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <assert.h>
+#include <getopt.h>
+
+#include "threadpool.h"
+#include "threadpool_lib.h"
+#include "parallel.h"
+#define DEFAULT_THREADS 4
+static int nthreads = DEFAULT_THREADS;
+static enum thread_pool_placement placement = THREAD_POOL_PLACE_NONE;
+
+typedef void (*sort_func)(int *, int);
+
+/* Return true if array 'a' is sorted. */
+static bool
+check_sorted(int a[], int n) 
+{
+    int i;
+    for (i = 0; i < n-1; i++)
+        if (a[i] > a[i+1])
+            return false;
+    return true;
+}
+
+/* The 64-bit keys of the last parallel run with -l, kept for
+ * check_wide_keys() so the check is not timed. */
+static uint64_t * wide_result = NULL;
+
+/* Return true if the 64-bit keys built from 'a0' are sorted and
+ * every key is still the one built for its original position: the
+ * lower halves, which hold those positions, must be a permutation of
+ * 0..n-1 and ascend among keys with equal upper halves, since an LSD
+ * radix sort is stable. */
+static bool
+check_wide_keys(uint64_t keys[], int a0[], int n)
+{
+    bool * seen = calloc(n, sizeof(bool));
+    bool ok = true;
+    int i;
+    for (i = 0; ok && i < n; i++) {
+        uint32_t pos = (uint32_t) keys[i];
+        if (pos >= (uint32_t) n || seen[pos] || keys[i] >> 32 != (uint32_t) a0[pos])
+            ok = false;
+        else if (i > 0 && keys[i] <= keys[i-1])
+            ok = false;
+        else
+            seen[pos] = true;
+    }
+    free(seen);
+    return ok;
+}
+
+/* ------------------------------------------------------------- 
+ * Built-in qsort.
+ */
+static int cmp_int(const void *a, const void *b)
+{
+    return *(int *)a - *(int *)b;
+}
+
+static void builtin_qsort(int *a, int N)
+{
+    qsort(a, N, sizeof(int), cmp_int);
+}
+
+/* ------------------------------------------------------------- 
+ * Serial implementation.
+ *
+ * The input comes from random(), so every key is non-negative and
+ * sorts the same as an int and as a uint32_t.
+ */
+static void
+radixsort_serial(int *array, int N)
+{
+    uint32_t * a = (uint32_t *) array;
+    uint32_t * tmp = malloc(sizeof(uint32_t) * N);
+    uint32_t * src = a, * dst = tmp;
+    int shift, i;
+
+    for (shift = 0; shift < 32; shift += 8) {
+        int count[257] = { 0 };
+        for (i = 0; i < N; i++)
+            count[((src[i] >> shift) & 255) + 1]++;
+        for (i = 0; i < 256; i++)
+            count[i + 1] += count[i];
+        for (i = 0; i < N; i++)
+            dst[count[(src[i] >> shift) & 255]++] = src[i];
+
+        uint32_t * t = src;
+        src = dst;
+        dst = t;
+    }
+    free(tmp);
+}
+
+/* ------------------------------------------------------------- 
+ * Parallel implementation.
+ */
+static bool wide_keys = false;
+
+static struct thread_pool *
+new_pool(void)
+{
+    struct thread_pool_options opts;
+    thread_pool_options_init(&opts, nthreads);
+    opts.placement = placement;
+    struct thread_pool * threadpool = thread_pool_new_with_options(&opts);
+    if (placement != THREAD_POOL_PLACE_NONE) {
+        int i;
+        printf("Worker placement:");
+        for (i = 0; i < nthreads; i++)
+            printf(" %d->cpu%d", i, thread_pool_worker_cpu(threadpool, i));
+        printf("\n");
+    }
+    return threadpool;
+}
+
+static void 
+radixsort_parallel(int *array, int N) 
+{
+    struct thread_pool * threadpool = new_pool();
+    if (!wide_keys) {
+        if (!par_radix_sort_u32(threadpool, (uint32_t *) array, N))
+            abort();
+    } else {
+        /* 64-bit keys that carry the value in the upper half and the
+         * original position in the lower one, so no pass is skipped */
+        uint64_t * keys = malloc(sizeof(uint64_t) * N);
+        int i;
+        for (i = 0; i < N; i++)
+            keys[i] = (uint64_t) array[i] << 32 | i;
+        if (!par_radix_sort_u64(threadpool, keys, N))
+            abort();
+        for (i = 0; i < N; i++)
+            array[i] = keys[i] >> 32;
+        wide_result = keys;
+    }
+    thread_pool_shutdown_and_destroy(threadpool);
+}
+
+/*
+ * Benchmark one run of sort_func sorter
+ */
+static void 
+benchmark(const char *benchmark_name, sort_func sorter, int *a0, int N, bool report)
+{
+    int *a = malloc(N * sizeof(int));
+    memcpy(a, a0, N * sizeof(int));
+
+    struct benchmark_data * bdata = start_benchmark();
+
+    // parallel section here, including thread pool startup and shutdown
+    sorter(a, N);
+
+    stop_benchmark(bdata);
+
+    // consistency check
+    if (!check_sorted(a, N)) {
+        fprintf(stderr, "Sort failed\n");
+        abort();
+    }
+    if (wide_result != NULL) {
+        if (!check_wide_keys(wide_result, a0, N)) {
+            fprintf(stderr, "Sort of 64-bit keys failed\n");
+            abort();
+        }
+        free(wide_result);
+        wide_result = NULL;
+    }
+
+    // report only if successful
+    if (report) {
+        report_benchmark_results(bdata);
+    }
+
+    printf("%s result ok. Timings follow\n", benchmark_name);
+    report_benchmark_results_to_human(stdout, bdata);
+
+    free(bdata);
+    free(a);
+}
+
+static void
+usage(char *av0, int exvalue)
+{
+    fprintf(stderr, "Usage: %s [-n <n>] [-p <policy>] [-l] [-b] [-q] [-s <n>] <N>\n"
+                    " -n        number of threads in pool, default %d\n"
+                    " -p        pin workers: compact, scatter or core, default unpinned\n"
+                    " -l        sort 64-bit keys instead of 32-bit keys\n"
+                    " -b        run built-in qsort\n"
+                    " -s        specify srand() seed\n"
+                    " -q        also run serial radix sort\n"
+                    , av0, DEFAULT_THREADS);
+    exit(exvalue);
+}
+
+int 
+main(int ac, char *av[]) 
+{
+    int c;
+    bool run_builtin_qsort = false;
+    bool run_serial_rsort = false;
+
+    while ((c = getopt(ac, av, "n:p:lbhs:q")) != EOF) {
+        switch (c) {
+        case 'n':
+            nthreads = atoi(optarg);
+            break;
+        case 'p':
+            if (strcmp(optarg, "compact") == 0)
+                placement = THREAD_POOL_PLACE_COMPACT;
+            else if (strcmp(optarg, "scatter") == 0)
+                placement = THREAD_POOL_PLACE_SCATTER;
+            else if (strcmp(optarg, "core") == 0)
+                placement = THREAD_POOL_PLACE_PHYSICAL_CORE;
+            else
+                usage(av[0], EXIT_FAILURE);
+            break;
+        case 'l':
+            wide_keys = true;
+            break;
+        case 's':
+            srand(atoi(optarg));
+            break;
+        case 'b':
+            run_builtin_qsort = true;
+            break;
+        case 'q':
+            run_serial_rsort = true;
+            break;
+        case 'h':
+            usage(av[0], EXIT_SUCCESS);
+        }
+    }
+    if (optind == ac)
+        usage(av[0], EXIT_FAILURE);
+
+    int N = atoi(av[optind]);
+
+    int i, * a0 = malloc(N * sizeof(int));
+    for (i = 0; i < N; i++)
+        a0[i] = random();
+
+    if (run_builtin_qsort)
+        benchmark("Built-in qsort", builtin_qsort, a0, N, false);
+
+    if (run_serial_rsort)
+        benchmark("radixsort serial", radixsort_serial, a0, N, false);
+
+    printf("Using %d threads, %d-bit keys\n", nthreads, wide_keys ? 64 : 32);
+    benchmark("radixsort parallel", radixsort_parallel, a0, N, true);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+/*
+ * Thread pool test program.
+ * Parallel prefix sum (scan).
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "threadpool.h"
+#include "threadpool_lib.h"
+#include "parallel.h"
+
+/* Addition for the generic scan. */
+static void
+add_int64(void *dst, const void *a, const void *b, void *ctx)
+{
+    *(int64_t *) dst = *(const int64_t *) a + *(const int64_t *) b;
+}
+
+static void usage(char *av0, int nthreads) {
+    fprintf(stderr, "Usage: %s [-n <n>] [-d|-g] [-e] <N>\n"
+                    " -n        number of threads in pool, default %d\n"
+                    " -d        scan doubles instead of int64_t\n"
+                    " -g        scan int64_t through the generic par_scan\n"
+                    " -e        exclusive instead of inclusive scan\n"
+                    , av0, nthreads);
+    exit(0);
+}
+
+int
+main(int ac, char *av[])
+{
+    int nthreads = 4;
+    bool use_double = false, use_generic = false;
+    enum par_scan_kind kind = PAR_SCAN_INCLUSIVE;
+    int c;
+    while ((c = getopt(ac, av, "n:dgeh")) != EOF) {
+        switch (c) {
+        case 'n':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            use_double = true;
+            break;
+        case 'g':
+            use_generic = true;
+            break;
+        case 'e':
+            kind = PAR_SCAN_EXCLUSIVE;
+            break;
+        case 'h':
+            usage(av[0], nthreads);
+        }
+    }
+    if (optind == ac)
+        usage(av[0], nthreads);
+
+    size_t len = atol(av[optind]);
+    struct thread_pool * pool = thread_pool_new(nthreads);
+
+    /* small integers, so double sums are exact as well */
+    int64_t * v = malloc(sizeof(int64_t) * len);
+    double * d = malloc(sizeof(double) * len);
+    size_t i;
+    for (i = 0; i < len; i++) {
+        v[i] = i % 7;
+        d[i] = v[i];
+    }
+
+    printf("starting...\n");
+    struct benchmark_data* bdata = start_benchmark();
+    if (use_double) {
+        par_scan_double(pool, d, d, len, kind);
+    } else if (use_generic) {
+        int64_t zero = 0;
+        if (!par_scan(pool, v, v, len, sizeof(int64_t), &zero, add_int64, NULL, kind))
+            abort();
+    } else {
+        par_scan_int64(pool, v, v, len, kind);
+    }
+    stop_benchmark(bdata);
+
+    int64_t sum = 0;
+    for (i = 0; i < len; i++) {
+        int64_t expect = kind == PAR_SCAN_INCLUSIVE ? sum + i % 7 : sum;
+        int64_t got = use_double ? (int64_t) d[i] : v[i];
+        if (got != expect) {
+            printf("result[%zu] %lld should be %lld\n", i, (long long) got, (long long) expect);
+            abort();
+        }
+        sum += i % 7;
+    }
+    printf("result ok.\n");
+    report_benchmark_results(bdata);
+
+    free(v);
+    free(d);
+    thread_pool_shutdown_and_destroy(pool);
+    return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * Fork/Join Framework
+ *
+ * Multi-producer submission benchmark.
+ *
+ * Several threads outside the pool submit small tasks at the same
+ * time, the way request threads of a server feed a pool.  Each
+ * producer keeps a window of tasks in flight: it submits the whole
+ * window, then joins and frees it.  Reports the submission
+ * throughput, through the lock-free injection queues or, with -L,
+ * through the locked global queue only.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "threadpool.h"
+#include "threadpool_lib.h"
+#define DEFAULT_THREADS 4
+#define DEFAULT_PRODUCERS 8
+#define DEFAULT_TASKS 100000
+#define DEFAULT_WINDOW 64
+
+static struct thread_pool *pool;
+static int ntasks = DEFAULT_TASKS;
+static int window = DEFAULT_WINDOW;
+static bool use_batch;
+
+static void *
+increment_task(struct thread_pool *pool, void * data)
+{
+    return (void *) ((uintptr_t) data + 1);
+}
+
+/* submits ntasks tasks, window by window, and checks their results */
+static void *
+producer(void * arg)
+{
+    struct future **f = malloc(sizeof(*f) * window);
+    void **data = malloc(sizeof(*data) * window);
+    uintptr_t bad = 0;
+    int done, i;
+
+    for (done = 0; done < ntasks; done += window) {
+        int n = ntasks - done < window ? ntasks - done : window;
+        for (i = 0; i < n; i++)
+            data[i] = (void *) (uintptr_t) (done + i);
+        if (use_batch) {
+            if (thread_pool_submit_batch(pool, n, increment_task, data, f) != n) {
+                fprintf(stderr, "Batch submission failed\n");
+                abort();
+            }
+        } else {
+            for (i = 0; i < n; i++)
+                f[i] = thread_pool_submit(pool, increment_task, data[i]);
+        }
+        for (i = 0; i < n; i++) {
+            if ((uintptr_t) future_get(f[i]) != (uintptr_t) data[i] + 1)
+                bad++;
+            future_free(f[i]);
+        }
+    }
+    free(f);
+    free(data);
+    return (void *) bad;
+}
+
+static int
+run_bench(int nthreads, int nproducers, bool locked)
+{
+    struct thread_pool_options opts;
+    thread_pool_options_init(&opts, nthreads);
+    if (locked)
+        opts.inject_capacity = 0;
+    pool = thread_pool_new_with_options(&opts);
+
+    pthread_t *producers = malloc(sizeof(*producers) * nproducers);
+    struct benchmark_data * bdata = start_benchmark();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int i;
+    for (i = 0; i < nproducers; i++)
+        pthread_create(&producers[i], NULL, producer, NULL);
+    uintptr_t bad = 0;
+    for (i = 0; i < nproducers; i++) {
+        void *r;
+        pthread_join(producers[i], &r);
+        bad += (uintptr_t) r;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stop_benchmark(bdata);
+    thread_pool_shutdown_and_destroy(pool);
+
+    if (bad != 0) {
+        fprintf(stderr, "Wrong result\n");
+        abort();
+    }
+
+    struct timespec diff = timespec_diff(start, end);
+    double secs = diff.tv_sec + diff.tv_nsec / 1e9;
+    long total = (long) nproducers * ntasks;
+    printf("%d producers submitted %ld tasks to %d workers through the %s queue in %.3f s, "
+           "%.0f tasks/s\n", nproducers, total, nthreads, locked ? "locked" : "injection",
+           secs, total / secs);
+    report_benchmark_results(bdata);
+    free(bdata);
+    free(producers);
+    return 0;
+}
+
+/**********************************************************************************/
+
+static void
+usage(char *av0, int exvalue)
+{
+    fprintf(stderr, "Usage: %s [-n <n>] [-p <n>] [-m <n>] [-w <n>] [-b] [-L]\n"
+                    " -n number of threads in pool, default %d\n"
+                    " -p number of producer threads, default %d\n"
+                    " -m number of tasks each producer submits, default %d\n"
+                    " -w number of tasks each producer keeps in flight, default %d\n"
+                    " -b submit each window with thread_pool_submit_batch\n"
+                    " -L submit through the locked global queue only\n"
+                    , av0, DEFAULT_THREADS, DEFAULT_PRODUCERS, DEFAULT_TASKS, DEFAULT_WINDOW);
+    exit(exvalue);
+}
+
+int
+main(int ac, char *av[])
+{
+    int c, nthreads = DEFAULT_THREADS, nproducers = DEFAULT_PRODUCERS;
+    bool locked = false;
+    while ((c = getopt(ac, av, "n:p:m:w:bLh")) != EOF) {
+        switch (c) {
+        case 'n':
+            nthreads = atoi(optarg);
+            break;
+        case 'p':
+            nproducers = atoi(optarg);
+            break;
+        case 'm':
+            ntasks = atoi(optarg);
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'b':
+            use_batch = true;
+            break;
+        case 'L':
+            locked = true;
+            break;
+        case 'h':
+            usage(av[0], EXIT_SUCCESS);
+        default:
+            usage(av[0], EXIT_FAILURE);
+        }
+    }
+    if (window < 1)
+        usage(av[0], EXIT_FAILURE);
+
+    return run_bench(nthreads, nproducers, locked);
+}
@@ -1,12 +1,27 @@
 /* includes */
 
+#define _GNU_SOURCE
 #include "threadpool.h"
 #include "list.h"
+#include "deque.h"
+#include "mpmc.h"
+#include "topology.h"
+#include "fiber.h"
+#include "trace.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 /* status of job */
 typedef enum {
@@ -15,88 +30,523 @@ typedef enum {
     COMPLETED = 2
 } status_t;
 
+/* set in future->status when a thread sleeps on it in futex_wait */
+#define FUTURE_WAITERS 0x100
+#define FUTURE_STATE(s) ((s) & ~FUTURE_WAITERS)
+
+/* future->conts once the future has completed and no continuation may be added */
+#define CONTS_CLOSED ((struct future *) 1)
+
+/* future->tombstone counts the parties done with a future that future_cancel()
+ * completed while it was still queued: the canceller, whoever takes the
+ * tombstone off its queue, and future_free(). the last of them frees it. */
+#define TOMBSTONE_PARTIES 3
+
+/* how often future_get polls before it sleeps */
+#define FUTURE_SPIN_COUNT 128
+
+/* initial capacity of each worker's deque, grows on demand */
+#define DEQUE_INITIAL_SIZE 256
+
+/* failed sweeps over our own NUMA node before stealing from other nodes */
+#define DEFAULT_REMOTE_STEAL_ROUNDS 4
+
+/* default idle policy: polls with pause, then with sched_yield, before parking */
+#define DEFAULT_SPIN_ITERATIONS 1000
+#define DEFAULT_YIELD_ITERATIONS 10
+
+/* stack of each fiber in fiber mode */
+#define DEFAULT_FIBER_STACK_SIZE (256 * 1024)
+
+/* external submitters are spread over this many shards, each with an
+ * injection queue per priority and a future cache of its own */
+#define INJECT_SHARDS 8
+#define DEFAULT_INJECT_CAPACITY 256
+
+/* most futures a worker takes off an injection queue at once */
+#define INJECT_BATCH 16
+
+/* events each worker's trace ring holds, see struct thread_pool_options */
+#define DEFAULT_TRACE_CAPACITY (64 * 1024)
+
+/* number of futures carved out of one slab */
+#define FUTURES_PER_SLAB 64
+
+/* iterations thread_pool_parallel_for() runs between checks whether to
+ * split its range. the chunk starts small so idle workers get work
+ * quickly, and doubles while nobody wants any so a busy pool pays
+ * little for the checks. */
+#define PARALLEL_FOR_MIN_CHUNK 1
+#define PARALLEL_FOR_MAX_CHUNK 256
+
+struct future;
+struct future_slab;
+
+/* freelist of futures. the owning worker allocates from and frees to
+ * 'free' without synchronization, other threads return futures through
+ * the lock-free 'remote_free' stack which the owner takes over whole. */
+struct future_cache {
+    struct future * free;
+    _Atomic(struct future *) remote_free;
+    struct future_slab * slabs;     /* every slab carved by this cache */
+};
+
+/* queue wait of the futures one worker took at one priority, only kept if
+ * the pool records latency. the histogram has one bucket per power of two
+ * nanoseconds. */
+#define LATENCY_BUCKETS 48
+struct latency_stats {
+    atomic_ulong count;
+    atomic_ulong total_ns;
+    atomic_ulong max_ns;
+    atomic_ulong hist[LATENCY_BUCKETS];
+};
+
+/* scheduler counters. only the owning worker writes them, so they are
+ * bumped with a relaxed load and store rather than an atomic add. other
+ * threads may read slightly stale values. */
+struct worker_stats {
+    atomic_ulong tasks;         /* tasks run, not counting cancelled ones */
+    atomic_ulong local_pops;    /* futures taken from our own deques */
+    atomic_ulong global_pops;   /* futures taken from the injection or global queues */
+    atomic_ulong busy_ns;       /* time spent running tasks, if the pool records it */
+    atomic_ulong steal_attempts;
+    atomic_ulong steals;
+    atomic_ulong remote_steals; /* steals from a worker on another NUMA node */
+    atomic_ulong spin_ns;       /* idle time spent in each phase of idle_wait() */
+    atomic_ulong yield_ns;
+    atomic_ulong park_ns;
+    struct latency_stats latency[THREAD_POOL_NUM_PRIOS];
+};
+
+#define STAT_ADD(counter, n) \
+    atomic_store_explicit(&(counter), \
+        atomic_load_explicit(&(counter), memory_order_relaxed) + (n), memory_order_relaxed)
+#define STAT_INC(counter) STAT_ADD(counter, 1)
+
+/* eventcount idle workers park on. a worker announces itself with
+ * ec_prepare_wait(), rechecks for work, and then either cancels or
+ * commits; a notify in between bumps the epoch so the commit does not
+ * sleep. each waiter sleeps with a futex bitset of its own, so
+ * ec_notify_bits() can wake one particular worker. */
+struct eventcount {
+    atomic_int epoch;
+    atomic_int nwaiters;
+};
+
+/* the stack a task runs on in fiber mode. a fiber stays with the worker
+ * that created it; once it has finished its task it goes on the worker's
+ * free list to run the next one. */
+struct task_fiber {
+    struct fiber fiber;
+    struct worker * home;
+    struct future * future;     /* the task this fiber runs */
+    bool done;                  /* finished, rather than suspended in a join */
+    struct task_fiber * next;   /* on the home worker's free or resumable list */
+    struct task_fiber * next_all;
+    uint32_t track;             /* its own track in a trace */
+};
+
+/* where non-worker threads submit. a submitter sticks to one shard, so
+ * submitters rarely share a queue or a cache lock. */
+struct inject_shard {
+    struct mpmc queue[THREAD_POOL_NUM_PRIOS];
+    pthread_mutex_t lock;       /* protects cache */
+    struct future_cache cache;
+} __attribute__((aligned(64)));
+
 /* worker info */
 struct worker {
+    struct deque deques[THREAD_POOL_NUM_PRIOS]; /* futures spawned by this worker, not yet started */
+    struct future_cache cache;
+    struct thread_pool * pool;
     pthread_t tid;
-    struct list worker_queue;
-    struct list_elem elem;
+    int id;
+    int cpu;                    /* pinned to, or -1 */
+    int node;                   /* NUMA node of cpu, 0 if not pinned */
+    uint32_t rng;               /* xorshift state for picking victims */
+    bool searching;             /* counted in pool->nsearching */
+    int last_victim;            /* worker we last stole from, or -1 */
+    int * local_victims;        /* other workers on our node */
+    int nlocal;
+    int * remote_victims;       /* workers on other nodes */
+    int nremote;
+    int failed_local_rounds;    /* consecutive local sweeps that found nothing */
+    atomic_bool parked;         /* sleeping on pool->idle */
+    unsigned wake_bit;          /* futex bitset we sleep with on pool->idle */
+    enum thread_pool_priority prio; /* of the task running now, inherited by what it spawns */
+    struct thread_pool_token * token; /* likewise */
+    struct fiber sched;         /* in fiber mode, the worker's own stack */
+    struct task_fiber * current;        /* fiber running now, NULL on our own stack */
+    struct task_fiber * free_fibers;
+    struct task_fiber * all_fibers;
+    int nsuspended;             /* fibers suspended in a join */
+    _Atomic(struct task_fiber *) resumable; /* suspended fibers whose join completed */
+    struct trace_ring * trace;  /* NULL unless the pool is traced */
+    unsigned long busy_since;   /* when the running task last started or resumed, 0 if none runs */
+    _Alignas(64) struct worker_stats stats; /* on lines of its own, since readers poll it */
 };
 
 /* pool info */
 struct thread_pool {
-    struct list worker_threads;
-    struct list global_queue;
+    struct worker * workers;
+    struct inject_shard * shards; /* external submissions */
+    size_t inject_capacity;     /* of each injection queue, 0 if there are none */
+    struct list global_queue[THREAD_POOL_NUM_PRIOS]; /* external submissions the injection queues had no room for, protected by lock */
+    atomic_int global_size[THREAD_POOL_NUM_PRIOS]; /* so workers can check global_queue without the lock */
     pthread_mutex_t lock;
-    pthread_cond_t work_flag;
+    struct eventcount idle;     /* parked workers */
     pthread_barrier_t start_sync;
-    bool shutdown;
+    atomic_int nsearching;      /* workers out of local work and trying to steal */
+    atomic_long npending[THREAD_POOL_NUM_PRIOS]; /* futures queued anywhere and not yet taken */
+    atomic_bool shutdown;
     int nthreads;
+    int spin_iterations;        /* idle policy, see struct thread_pool_options */
+    int yield_iterations;
+    int remote_steal_rounds;
+    int nnodes;                 /* highest NUMA node of any worker + 1 */
+    bool fibers;                /* run tasks on fibers, see struct thread_pool_options */
+    bool record_latency;        /* time how long futures wait in queues */
+    bool record_busy_time;      /* time how long tasks run */
+    size_t fiber_stack_size;
+    atomic_size_t slab_futures; /* futures carved from slabs so far */
+    struct thread_pool * next_live; /* on live_pools */
+    char * trace_file;          /* where to write the trace, NULL if not tracing */
+    struct trace_sync trace_start;
+    atomic_uint next_track;     /* for fibers, after one per worker */
 };
 
+/* every pool that has not been destroyed yet, and the summed stats of those
+ * that have, for thread_pool_get_process_stats() */
+static pthread_mutex_t live_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_pool * live_pools;
+static struct thread_pool_stats destroyed_stats;
+
 /* future info */
 struct future {
     void * data;
     void * result;
     struct list_elem elem;
     struct thread_pool * pool;
-    pthread_cond_t done;
     fork_join_task_t task;
-    status_t status;
+    atomic_int status;          /* status_t, plus FUTURE_WAITERS */
+    bool cancelled;             /* completed without running its task */
+    atomic_int tombstone;       /* see TOMBSTONE_PARTIES */
+    enum thread_pool_priority prio;
+    struct thread_pool_token * token; /* cancels the task if it has not started yet */
+    unsigned long enqueued_ns;  /* when it was queued, if the pool records latency */
+    struct future_cache * home; /* the cache this future returns to */
+    struct future * next_free;
+    _Atomic(struct future *) conts; /* continuations to schedule on completion, or CONTS_CLOSED */
+    struct future * next_cont;  /* on the conts list of the future we continue */
+    void (* fire)(struct thread_pool *, struct future *); /* for triggers, see complete_future */
+};
+
+/* a group of tasks that can be cancelled together */
+struct thread_pool_token {
+    atomic_bool cancelled;
+};
+
+/* a future_when_all() or future_when_any() waiting for its inputs. each
+ * input has a trigger on its conts list: a future without a task that is
+ * fired instead of scheduled. */
+struct when_state {
+    struct future * combined;   /* the future handed to the caller */
+    atomic_int remaining;       /* triggers not yet fired */
+    bool any;
+    int n;
+    struct future triggers[];
+};
+
+_Static_assert(sizeof(struct future) <= sizeof(struct future_storage),
+               "struct future_storage is too small for struct future");
+
+/* a chunk of futures, released when the pool is destroyed */
+struct future_slab {
+    struct future_slab * next;
+    struct future futures[FUTURES_PER_SLAB];
 };
 
 //#define DEBUG
 
 /* save worker info local so the thread knows itself
- * can still access other worker threads info through 
- * pool queue */
+ * can still access other worker threads info through
+ * pool->workers. NULL in threads that are not workers. */
 static __thread struct worker * w;
-static __thread bool is_worker;
 
-static struct list_elem * steal_task(struct thread_pool * p);
-static bool sleeping(struct thread_pool *);
+static struct future * find_task(struct thread_pool *, struct worker *);
+static struct future * steal_task(struct thread_pool *, struct worker *, int);
+static struct future * pop_own(struct thread_pool *, struct worker *);
+static inline bool work_available(struct thread_pool *);
+static void notify_workers(struct thread_pool *, int);
+static void ec_notify(struct eventcount *, int);
+static void run_future(struct thread_pool *, struct future *);
+static void complete_future(struct thread_pool *, struct future *, void *);
+static void when_fire(struct thread_pool *, struct future *);
+static bool enqueue_future(struct thread_pool *, struct worker *, struct future *);
+static struct inject_shard * my_shard(struct thread_pool *);
+static bool inject(struct thread_pool *, struct inject_shard *, struct future *);
+static struct future * future_alloc(struct thread_pool *, struct future_cache *);
+static void future_release(struct future *);
+static void future_cache_init(struct future_cache *);
+static void future_cache_destroy(struct future_cache *);
 static void * working_thread(void *);
+static void futex_wait(atomic_int *, int);
+static void futex_wake(atomic_int *, int);
+static void futex_wait_bits(atomic_int *, int, unsigned);
+static void futex_wake_bits(atomic_int *, int, unsigned);
+static void future_wait(struct future *);
+static void idle_wait(struct thread_pool *, struct worker *);
+static void add_stats(struct thread_pool_stats *, struct thread_pool *);
+static void write_trace(struct thread_pool *);
+
+/* the calling thread's worker if it belongs to this pool */
+static inline struct worker * current_worker(struct thread_pool * pool) {
+    return (w != NULL && w->pool == pool) ? w : NULL;
+}
+
+/* priority for new futures: that of the task we are running, if any */
+static inline enum thread_pool_priority current_prio(struct worker * me) {
+    return me != NULL ? me->prio : THREAD_POOL_PRIO_NORMAL;
+}
+
+/* token for new futures: likewise */
+static inline struct thread_pool_token * current_token(struct worker * me) {
+    return me != NULL ? me->token : NULL;
+}
+
+/* the trace track of what me runs: its own, or that of the fiber it is on.
+ * callers check me->trace first, so tracing costs a branch when it is off. */
+static inline uint32_t trace_track(struct worker * me) {
+    return me->current != NULL ? me->current->track : (uint32_t) me->id;
+}
+
+static inline void trace_instant(struct worker * me, enum trace_type type, struct future * f, int arg) {
+    uint64_t now = trace_clock();
+    trace_add(me->trace, type, trace_track(me), now, now, (uintptr_t) f, arg);
+}
+
+static inline unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
 
-/* raise shutdown flag and free variable */
+/* raise shutdown flag and free variable. from here on, queued futures are
+ * completed as cancelled instead of being run, see run_future */
 void thread_pool_shutdown_and_destroy(struct thread_pool * t) {
-    pthread_mutex_lock(&t->lock);
-    t->shutdown = true;
-    
+    atomic_store(&t->shutdown, true);
+
     /* wake all threads so they can shutdown */
-    pthread_cond_broadcast(&t->work_flag);
-    pthread_mutex_unlock(&t->lock);
+    ec_notify(&t->idle, INT_MAX);
 
     #ifdef DEBUG
         printf("Shutdown signaled, joining threads.\n");
     #endif
 
-
     /* threads join here */
-    struct list_elem * we;
-    struct worker * w;
-    for (we = list_begin(&t->worker_threads); we != list_end(&t->worker_threads); we = list_next(we)) {
-        w = list_entry(we, struct worker, elem);
-        if ((pthread_join(w->tid, NULL)) != 0) {
+    int i;
+    for (i = 0; i < t->nthreads; i++) {
+        if ((pthread_join(t->workers[i].tid, NULL)) != 0) {
             printf("Error joing threads.\n");
         }
     }
 
-    /* free worker structs */
-    while (!list_empty(&t->worker_threads)) {
-        we = list_pop_front(&t->worker_threads);
-        w = list_entry(we, struct worker, elem);
-        free(w);
+    if (t->trace_file != NULL) {
+        write_trace(t);
+    }
+
+    /* fold our stats into the process totals */
+    pthread_mutex_lock(&live_pools_lock);
+    add_stats(&destroyed_stats, t);
+    struct thread_pool ** pp = &live_pools;
+    while (*pp != t) {
+        pp = &(*pp)->next_live;
+    }
+    *pp = t->next_live;
+    pthread_mutex_unlock(&live_pools_lock);
+
+    /* free worker deques and futures */
+    for (i = 0; i < t->nthreads; i++) {
+        int p;
+        for (p = 0; p < THREAD_POOL_NUM_PRIOS; p++) {
+            deque_destroy(&t->workers[i].deques[p]);
+        }
+        future_cache_destroy(&t->workers[i].cache);
+        free(t->workers[i].local_victims);
+        free(t->workers[i].remote_victims);
+
+        if (t->workers[i].trace != NULL) {
+            trace_destroy(t->workers[i].trace);
+            free(t->workers[i].trace);
+        }
+
+        /* fibers still suspended in a join belong to tasks that will never finish */
+        while (t->workers[i].all_fibers != NULL) {
+            struct task_fiber * fb = t->workers[i].all_fibers;
+            t->workers[i].all_fibers = fb->next_all;
+            fiber_destroy(&fb->fiber);
+            free(fb);
+        }
     }
+    for (i = 0; i < INJECT_SHARDS; i++) {
+        struct inject_shard * s = &t->shards[i];
+        if (t->inject_capacity > 0) {
+            int p;
+            for (p = 0; p < THREAD_POOL_NUM_PRIOS; p++) {
+                mpmc_destroy(&s->queue[p]);
+            }
+        }
+        future_cache_destroy(&s->cache);
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(t->shards);
+    free(t->trace_file);
+    free(t->workers);
 
     /* free condition vars and self */
     pthread_mutex_destroy(&t->lock);
-    pthread_cond_destroy(&t->work_flag);
     pthread_barrier_destroy(&t->start_sync);
     free(t);
 }
 
+/* dump every worker's trace ring, once the workers have exited. workers and
+ * the fibers they ran tasks on get a track each. */
+static void write_trace(struct thread_pool * pool) {
+    FILE * f = fopen(pool->trace_file, "w");
+    if (f == NULL) {
+        printf("Error opening trace file %s.\n", pool->trace_file);
+        return;
+    }
+
+    struct trace_sync end;
+    trace_sync(&end);
+    trace_write_begin(f);
+    int i;
+    for (i = 0; i < pool->nthreads; i++) {
+        struct worker * wt = &pool->workers[i];
+        char name[64];
+        snprintf(name, sizeof name, "worker %d", i);
+        trace_write_track_name(f, i, name);
+        struct task_fiber * fb;
+        for (fb = wt->all_fibers; fb != NULL; fb = fb->next_all) {
+            snprintf(name, sizeof name, "worker %d fiber %u", i, fb->track);
+            trace_write_track_name(f, fb->track, name);
+        }
+        trace_write_events(f, wt->trace, &pool->trace_start, &end);
+    }
+    trace_write_end(f);
+    fclose(f);
+}
+
+/* default options for a pool of nthreads workers */
+void thread_pool_options_init(struct thread_pool_options * opts, int nthreads) {
+    opts->nthreads = nthreads;
+    opts->spin_iterations = DEFAULT_SPIN_ITERATIONS;
+    opts->yield_iterations = DEFAULT_YIELD_ITERATIONS;
+    opts->placement = THREAD_POOL_PLACE_NONE;
+    opts->cpus = NULL;
+    opts->ncpus = 0;
+    opts->remote_steal_rounds = DEFAULT_REMOTE_STEAL_ROUNDS;
+    opts->fibers = false;
+    opts->fiber_stack_size = DEFAULT_FIBER_STACK_SIZE;
+    opts->record_latency = false;
+    opts->record_busy_time = false;
+    opts->inject_capacity = DEFAULT_INJECT_CAPACITY;
+    opts->trace_file = NULL;
+    opts->trace_capacity = DEFAULT_TRACE_CAPACITY;
+}
+
+/* decide which CPU, and therefore NUMA node, each worker is pinned to.
+ * unpinned workers may run anywhere and are all treated as node 0. */
+static void place_workers(struct thread_pool * pool, const struct thread_pool_options * opts) {
+    int i;
+    for (i = 0; i < pool->nthreads; i++) {
+        pool->workers[i].cpu = -1;
+        pool->workers[i].node = 0;
+    }
+    pool->nnodes = 1;
+
+    if ((opts->cpus == NULL || opts->ncpus <= 0) && opts->placement == THREAD_POOL_PLACE_NONE) {
+        return;
+    }
+
+    struct topology topo;
+    if (!topology_read(&topo)) {
+        printf("Error reading CPU topology, workers are not pinned.\n");
+        return;
+    }
+
+    int cpus[pool->nthreads];
+    if (opts->cpus != NULL && opts->ncpus > 0) {
+        for (i = 0; i < pool->nthreads; i++) {
+            cpus[i] = opts->cpus[i % opts->ncpus];
+        }
+    } else {
+        topology_place(&topo, opts->placement, pool->nthreads, cpus);
+    }
+
+    for (i = 0; i < pool->nthreads; i++) {
+        struct worker * wt = &pool->workers[i];
+        if (!topology_has_cpu(&topo, cpus[i])) {
+            /* pthread_create would fail with EINVAL on a CPU we may not run on */
+            printf("CPU %d is offline or not allowed, worker %d is not pinned.\n", cpus[i], i);
+            continue;
+        }
+        wt->cpu = cpus[i];
+        wt->node = topology_cpu_node(&topo, cpus[i]);
+        if (wt->node >= pool->nnodes) {
+            pool->nnodes = wt->node + 1;
+        }
+    }
+    topology_free(&topo);
+}
+
+/* split every worker's potential victims into those on its own node and the rest */
+static bool group_victims(struct thread_pool * pool) {
+    int i, j;
+    for (i = 0; i < pool->nthreads; i++) {
+        struct worker * wt = &pool->workers[i];
+        wt->local_victims = malloc(pool->nthreads * sizeof(int));
+        wt->remote_victims = malloc(pool->nthreads * sizeof(int));
+        if (wt->local_victims == NULL || wt->remote_victims == NULL) {
+            return false;
+        }
+        wt->nlocal = wt->nremote = 0;
+        wt->failed_local_rounds = 0;
+        for (j = 0; j < pool->nthreads; j++) {
+            if (j == i) {
+                continue;
+            }
+            if (pool->workers[j].node == wt->node) {
+                wt->local_victims[wt->nlocal++] = j;
+            } else {
+                wt->remote_victims[wt->nremote++] = j;
+            }
+        }
+    }
+    return true;
+}
+
+int thread_pool_worker_cpu(struct thread_pool * pool, int worker) {
+    if (worker < 0 || worker >= pool->nthreads) {
+        return -1;
+    }
+    return pool->workers[worker].cpu;
+}
+
 /* thread pool creation */
 struct thread_pool * thread_pool_new(int nthreads) {
-    
+    struct thread_pool_options opts;
+    thread_pool_options_init(&opts, nthreads);
+    return thread_pool_new_with_options(&opts);
+}
+
+/* thread pool creation with a non-default configuration */
+struct thread_pool * thread_pool_new_with_options(const struct thread_pool_options * opts) {
+
+    int nthreads = opts->nthreads;
+
     struct thread_pool * pool;
     if ((pool = malloc(sizeof(struct thread_pool))) == NULL) {
         printf("Error malloc'ing thread pool.\n");
@@ -107,284 +557,1643 @@ struct thread_pool * thread_pool_new(int nthreads) {
         printf("Error initializing lock.\n");
         return NULL;
     }
-    
-    if ((pthread_cond_init(&pool->work_flag, NULL)) != 0) {
-        printf("Error initializing work_flag.\n");
-        return NULL;
-    }
 
     if ((pthread_barrier_init(&pool->start_sync, NULL, nthreads + 1)) != 0) {
         printf("Error initializing start_sync.\n");
         return NULL;
     }
 
-    pthread_mutex_lock(&pool->lock);
+    /* workers are cache line aligned so their deques do not share lines */
+    if ((posix_memalign((void **) &pool->workers, 64, nthreads * sizeof(struct worker))) != 0) {
+        printf("Error malloc'ing worker threads.\n");
+        return NULL;
+    }
 
-    list_init(&pool->worker_threads);
-    list_init(&pool->global_queue);
-    pool->shutdown = false;   
+    int i, p;
+    for (p = 0; p < THREAD_POOL_NUM_PRIOS; p++) {
+        list_init(&pool->global_queue[p]);
+        atomic_init(&pool->global_size[p], 0);
+        atomic_init(&pool->npending[p], 0);
+    }
+    atomic_init(&pool->idle.epoch, 0);
+    atomic_init(&pool->idle.nwaiters, 0);
+    atomic_init(&pool->nsearching, 0);
+    atomic_init(&pool->shutdown, false);
     pool->nthreads = nthreads;
-
-    /* initialize and create worker threads */
-    int i;
-    for (i = 0;i < nthreads; i++) {
-        struct worker * wt;
-        if ((wt = malloc(sizeof(struct worker))) == NULL) {
-            printf("Error malloc'ing worker thread.\n");
+    pool->spin_iterations = opts->spin_iterations;
+    pool->yield_iterations = opts->yield_iterations;
+    pool->remote_steal_rounds = opts->remote_steal_rounds;
+    pool->fibers = opts->fibers;
+    pool->fiber_stack_size = opts->fiber_stack_size;
+    pool->record_latency = opts->record_latency;
+    pool->record_busy_time = opts->record_busy_time;
+    /* round the injection queues up to a power of two */
+    pool->inject_capacity = 0;
+    if (opts->inject_capacity > 0) {
+        pool->inject_capacity = 1;
+        while (pool->inject_capacity < opts->inject_capacity) {
+            pool->inject_capacity *= 2;
+        }
+    }
+    if ((posix_memalign((void **) &pool->shards, 64, INJECT_SHARDS * sizeof(struct inject_shard))) != 0) {
+        printf("Error malloc'ing injection queues.\n");
+        return NULL;
+    }
+    for (i = 0; i < INJECT_SHARDS; i++) {
+        struct inject_shard * s = &pool->shards[i];
+        if ((pthread_mutex_init(&s->lock, NULL)) != 0) {
+            printf("Error initializing lock.\n");
             return NULL;
         }
+        future_cache_init(&s->cache);
+        for (p = 0; p < THREAD_POOL_NUM_PRIOS && pool->inject_capacity > 0; p++) {
+            if (!mpmc_init(&s->queue[p], pool->inject_capacity)) {
+                printf("Error initializing injection queue.\n");
+                return NULL;
+            }
+        }
+    }
+    atomic_init(&pool->slab_futures, 0);
 
-        list_push_front(&pool->worker_threads, &wt->elem);
-        list_init(&wt->worker_queue);
-        
-        if ((pthread_create(&wt->tid, NULL, working_thread, pool)) != 0) {
-            printf("Error creating worker thread.\n");
+    /* tracing is off unless asked for in the options or the environment */
+    const char * trace_file = opts->trace_file != NULL ? opts->trace_file : getenv("THREADPOOL_TRACE");
+    size_t trace_capacity = 1;
+    pool->trace_file = NULL;
+    if (trace_file != NULL && *trace_file != '\0') {
+        if ((pool->trace_file = strdup(trace_file)) == NULL) {
+            printf("Error malloc'ing trace file name.\n");
             return NULL;
         }
-        #ifdef DEBUG
-            printf("Created worker thread %d with tid %d.\n", i, (int) wt->tid);
-        #endif
+        while (trace_capacity < opts->trace_capacity) {
+            trace_capacity *= 2;
+        }
+    }
+    atomic_init(&pool->next_track, nthreads);
+
+    /* initialize all workers before any of them can start stealing */
+    for (i = 0; i < nthreads; i++) {
+        struct worker * wt = &pool->workers[i];
+        for (p = 0; p < THREAD_POOL_NUM_PRIOS; p++) {
+            if (!deque_init(&wt->deques[p], DEQUE_INITIAL_SIZE)) {
+                printf("Error initializing worker deque.\n");
+                return NULL;
+            }
+        }
+        future_cache_init(&wt->cache);
+        wt->pool = pool;
+        wt->id = i;
+        wt->rng = (i + 1) * 2654435761u;
+        wt->last_victim = -1;
+        wt->searching = false;
+        atomic_init(&wt->parked, false);
+        wt->wake_bit = 1u << (i % 32);
+        wt->prio = THREAD_POOL_PRIO_NORMAL;
+        wt->token = NULL;
+        wt->current = NULL;
+        wt->free_fibers = NULL;
+        wt->all_fibers = NULL;
+        wt->nsuspended = 0;
+        atomic_init(&wt->resumable, NULL);
+        wt->trace = NULL;
+        wt->busy_since = 0;
+        if (pool->trace_file != NULL) {
+            if ((wt->trace = malloc(sizeof(struct trace_ring))) == NULL
+                || !trace_init(wt->trace, trace_capacity)) {
+                printf("Error malloc'ing trace ring.\n");
+                return NULL;
+            }
+        }
+        atomic_init(&wt->stats.tasks, 0);
+        atomic_init(&wt->stats.local_pops, 0);
+        atomic_init(&wt->stats.global_pops, 0);
+        atomic_init(&wt->stats.busy_ns, 0);
+        atomic_init(&wt->stats.steal_attempts, 0);
+        atomic_init(&wt->stats.steals, 0);
+        atomic_init(&wt->stats.remote_steals, 0);
+        atomic_init(&wt->stats.spin_ns, 0);
+        atomic_init(&wt->stats.yield_ns, 0);
+        atomic_init(&wt->stats.park_ns, 0);
+        for (p = 0; p < THREAD_POOL_NUM_PRIOS; p++) {
+            struct latency_stats * ls = &wt->stats.latency[p];
+            int b;
+            atomic_init(&ls->count, 0);
+            atomic_init(&ls->total_ns, 0);
+            atomic_init(&ls->max_ns, 0);
+            for (b = 0; b < LATENCY_BUCKETS; b++) {
+                atomic_init(&ls->hist[b], 0);
+            }
+        }
     }
 
-    if ((w = malloc(sizeof(struct worker))) == NULL) {
-        printf("Error malloc'ing worker thread.\n");
+    trace_sync(&pool->trace_start);
+    place_workers(pool, opts);
+    if (!group_victims(pool)) {
+        printf("Error malloc'ing victim lists.\n");
         return NULL;
     }
 
-    w->tid = pthread_self();
-    list_init(&w->worker_queue);
-    is_worker = false;
+    /* create worker threads, pinned from the start so they never run elsewhere */
+    for (i = 0; i < nthreads; i++) {
+        struct worker * wt = &pool->workers[i];
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (wt->cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(wt->cpu, &set);
+            if (pthread_attr_setaffinity_np(&attr, sizeof set, &set) != 0) {
+                wt->cpu = -1;
+            }
+        }
+        if (wt->cpu >= 0 && pthread_create(&wt->tid, &attr, working_thread, wt) != 0) {
+            /* the CPU went offline since we placed the worker, run it unpinned */
+            printf("Error pinning worker %d to CPU %d, worker is not pinned.\n", i, wt->cpu);
+            pthread_attr_destroy(&attr);
+            pthread_attr_init(&attr);
+            wt->cpu = -1;
+        }
+        if (wt->cpu < 0 && (pthread_create(&wt->tid, &attr, working_thread, wt)) != 0) {
+            printf("Error creating worker thread.\n");
+            return NULL;
+        }
+        pthread_attr_destroy(&attr);
+        #ifdef DEBUG
+            printf("Created worker thread %d with tid %d on cpu %d.\n", i, (int) wt->tid, wt->cpu);
+        #endif
+    }
 
-    pthread_mutex_unlock(&pool->lock);
-    
     pthread_barrier_wait(&pool->start_sync);
 
+    pthread_mutex_lock(&live_pools_lock);
+    pool->next_live = live_pools;
+    live_pools = pool;
+    pthread_mutex_unlock(&live_pools_lock);
     return pool;
 }
 
-/* submit a job to be completed. could be externally or internally requested */
-struct future * thread_pool_submit( struct thread_pool *pool,  fork_join_task_t task, void * data) {
-    
-    pthread_mutex_lock(&pool->lock);
-        
+/* allocate a future for a task from the cache of the calling thread */
+static struct future * new_future(struct thread_pool * pool, struct worker * me,
+                                  fork_join_task_t task, void * data) {
     struct future * f;
-   
-    if ((f = malloc(sizeof(struct future))) == NULL) {
-        printf("Error mallc'ing future.\n");
-        return NULL;
+
+    /* check for internal / external submission */
+    if (me != NULL) {
+        f = future_alloc(pool, &me->cache);
+    } else {
+        struct inject_shard * s = my_shard(pool);
+        pthread_mutex_lock(&s->lock);
+        f = future_alloc(pool, &s->cache);
+        pthread_mutex_unlock(&s->lock);
     }
 
-    if ((pthread_cond_init(&f->done, NULL)) != 0) {
-        printf("Error initializing future->done.\n");
+    if (f == NULL) {
+        printf("Error allocating future.\n");
         return NULL;
     }
 
     f->task = task;
     f->data = data;
-    f->status = NOT_STARTED;
-    f->pool = pool;
+    f->prio = current_prio(me);
+    f->token = current_token(me);
+    return f;
+}
 
-    /* check for internal / external submission */
-    if (is_worker) {
-        #ifdef DEBUG
-            printf("Received internal thread_pool_submit, pushing onto worker's stack\n");
-        #endif
-        list_push_front(&w->worker_queue, &f->elem);
-    } else {
-        #ifdef DEBUG
-            printf("Received external thread_pool_submit, pushing onto global queue\n");
-        #endif
-        list_push_back(&pool->global_queue, &f->elem);
+/* enqueue a future taken by new_future(). if it cannot be queued it goes
+ * back to the cache it came from, and we return NULL */
+static struct future * submit_future(struct thread_pool * pool, struct worker * me, struct future * f) {
+    if (enqueue_future(pool, me, f)) {
+        return f;
     }
+    /* only the push onto our own deque fails, so f was never published
+     * and this is an owner free into me->cache */
+    future_release(f);
+    return NULL;
+}
 
-    #ifdef DEBUG
-        printf("Sending signal to sleeping workers...\n");
-    #endif
-
-    pthread_cond_signal(&pool->work_flag);
-    pthread_mutex_unlock(&pool->lock);
+/* submit a job to be completed. could be externally or internally requested */
+struct future * thread_pool_submit( struct thread_pool *pool,  fork_join_task_t task, void * data) {
+    struct worker * me = current_worker(pool);
+    struct future * f = new_future(pool, me, task, data);
 
-    return f;
+    if (f == NULL) {
+        return NULL;
+    }
+    return submit_future(pool, me, f);
 }
 
-/* worker thread function */
-static void * working_thread(void * param) {
-    struct thread_pool * pool = (struct thread_pool *) param;
-  
-    /* wait for all worker threads to be created before workers start working */
-    pthread_barrier_wait(&pool->start_sync);
+/* submit a job that is taken ahead of all queued jobs of lower priority */
+struct future * thread_pool_submit_prio(struct thread_pool * pool, enum thread_pool_priority prio,
+                                        fork_join_task_t task, void * data) {
+    struct worker * me = current_worker(pool);
+    struct future * f = new_future(pool, me, task, data);
 
-    bool first = true;
-    /* run loop */
-    while (1) {
-    
-        pthread_mutex_lock(&pool->lock);
-       
-        /* if in creation, set local worker info */
-        if (first) {
-            pthread_t tid = pthread_self();
-            struct list_elem * we;
-            struct worker * wt = NULL;
-            for (we = list_begin(&pool->worker_threads); we != list_end(&pool->worker_threads); we = list_next(we)) {
-                wt = list_entry(we, struct worker, elem);
-
-                if (tid == wt->tid) {
-                    w = wt;
-                    break;
-                }
-            }
-            is_worker = true;
-            first = false;
-        }
+    if (f == NULL) {
+        return NULL;
+    }
+    f->prio = prio;
+    return submit_future(pool, me, f);
+}
 
-        /* surrounded in loop to prevent spurious wake ups */
-        while(sleeping(pool)) {
-            #ifdef DEBUG
-                printf("No work, now sleeping.\n");
-            #endif
-            pthread_cond_wait(&pool->work_flag, &pool->lock);
-        }
-        
-        #ifdef DEBUG
-            printf("Awoken worker thread: %d.\n", (int) w->tid);
-        #endif
-       
-        /* if shutdown break out of run loop */
-        if (pool->shutdown) {
-            break;
-        }
-      
-        #ifdef DEBUG
-            printf("Doing work.\n");
-        #endif
-       
-        /* first check worker's own queue, then check global queue,
-         * and finally steal from other workers if the first two
-         * are empty. */
-        struct list_elem * e;
-        if (list_empty(&w->worker_queue)) {
-            if (list_empty(&pool->global_queue)) {
-                e = steal_task(pool);
-            } else {   
-                e = list_pop_front(&pool->global_queue);
-            }
-        } else {
-            e = list_pop_front(&w->worker_queue);
-        }
-   
-        /* this should never return error as the mutex is still held,
-         * and therefore no changes should be made in any queue */
-        if (e == NULL) {
-            printf("Error finding task.\n");
-            pool->shutdown = true;
-            break;
+/* put c on f's continuation list. returns false if f has already completed */
+static bool add_continuation(struct future * f, struct future * c) {
+    struct future * head = atomic_load_explicit(&f->conts, memory_order_acquire);
+    while (head != CONTS_CLOSED) {
+        c->next_cont = head;
+        if (atomic_compare_exchange_weak_explicit(&f->conts, &head, c,
+                                                  memory_order_release, memory_order_acquire)) {
+            return true;
         }
-     
-        /* get future and run it */
-        struct future * f = list_entry(e, struct future, elem);
-        
-        f->status = IN_PROGRESS;
+    }
+    return false;
+}
 
-        /* cant forget to release the lock! */
-        pthread_mutex_unlock(&pool->lock);
+/* schedule a task to run once f has completed. while f runs, the
+ * continuation waits on f's conts list, and the worker that completes f
+ * pushes it onto its own deque. once the list is closed f is done and we
+ * enqueue the continuation ourselves. */
+struct future * future_then(struct future * f, fork_join_task_t task, void * data) {
+    struct thread_pool * pool = f->pool;
+    struct worker * me = current_worker(pool);
+    struct future * c = new_future(pool, me, task, data);
 
-        f->result = (f->task)(pool, f->data);
-       
-        /* task is done, reacquire lock and notify any thread waiting
-         * on future */
-        pthread_mutex_lock(&pool->lock);
-        
-        f->status = COMPLETED;
-        pthread_cond_signal(&f->done);       
+    if (c == NULL) {
+        return NULL;
+    }
 
-        pthread_mutex_unlock(&pool->lock);   
+    if (add_continuation(f, c)) {
+        return c;
     }
+    return submit_future(pool, me, c);
+}
 
-    /* pool is shutting down */
-    pthread_mutex_unlock(&pool->lock);
-    
-    #ifdef DEBUG
-        printf("Exiting thread %d\n", (int) w->tid);
-    #endif
-    
-    pthread_exit(NULL);
-    return NULL;
+/* a future that completes when all n futures, or the first of them, have
+ * completed. its result is NULL for when_all and the index of the first
+ * future to complete for when_any. */
+static struct future * when(struct future ** futures, int n, bool any) {
+    struct thread_pool * pool = futures[0]->pool;
+    struct future * combined = new_future(pool, current_worker(pool), NULL, NULL);
+    struct when_state * ws;
+    int i;
+
+    if (combined == NULL) {
+        return NULL;
+    }
+    ws = malloc(sizeof(struct when_state) + n * sizeof(struct future));
+    if (ws == NULL) {
+        printf("Error allocating future combinator.\n");
+        future_free(combined);
+        return NULL;
+    }
+    ws->combined = combined;
+    atomic_init(&ws->remaining, n);
+    ws->any = any;
+    ws->n = n;
+
+    /* once the last trigger is on its list, ws may be fired and freed at any time */
+    for (i = 0; i < n; i++) {
+        struct future * t = &ws->triggers[i];
+        t->task = NULL;
+        t->fire = when_fire;
+        t->data = ws;
+        if (!add_continuation(futures[i], t)) {
+            when_fire(pool, t);
+        }
+    }
+    return combined;
 }
 
-/* returns a future once it has finished executing */
-void * future_get(struct future * f) { 
-   
-    #ifdef DEBUG
-        printf("future_get called.\n");
-    #endif
+struct future * future_when_all(struct future ** futures, int n) {
+    if (n <= 0) {
+        return NULL;
+    }
+    return when(futures, n, false);
+}
 
-    pthread_mutex_lock(&f->pool->lock);
-   
-    /* if not started, thread helps in execution */
-    if (f->status == NOT_STARTED) {
-        #ifdef DEBUG
-            printf("Task not yet started, starting now.\n");
-        #endif
-    
-        list_remove(&f->elem);
-        f->status = IN_PROGRESS;
+struct future * future_when_any(struct future ** futures, int n) {
+    if (n <= 0) {
+        return NULL;
+    }
+    return when(futures, n, true);
+}
 
-        pthread_mutex_unlock(&f->pool->lock);
-    
-        f->result = (f->task)(f->pool, f->data);
+/* one input of a combinator has completed. when_all completes with the last
+ * input, when_any with the first. the last trigger to fire frees the state. */
+static void when_fire(struct thread_pool * pool, struct future * t) {
+    struct when_state * ws = t->data;
+    struct future * combined = ws->combined;
+    int n = ws->n;
+    bool any = ws->any;
+    int index = t - ws->triggers;
 
-        pthread_mutex_lock(&f->pool->lock);
+    int old = atomic_fetch_sub_explicit(&ws->remaining, 1, memory_order_acq_rel);
+    if (old == 1) {
+        free(ws);
+    }
+    if (any ? old == n : old == 1) {
+        complete_future(pool, combined, any ? (void *) (intptr_t) index : NULL);
+    }
+}
 
-        f->status = COMPLETED; 
-    } else {
-        while (f->status != COMPLETED) {       
-            #ifdef DEBUG
-                printf("Task already started, waiting for completion.\n");
-            #endif
-            pthread_cond_wait(&f->done, &f->pool->lock);
+/* submit n tasks at once with a single push and a single wakeup. the caller
+ * gets one future per task in futures[]. returns the number of tasks submitted,
+ * which is either n or 0. */
+int thread_pool_submit_batch(struct thread_pool * pool, int n, fork_join_task_t task,
+                             void * data[], struct future * futures[]) {
+
+    struct worker * me = current_worker(pool);
+    struct inject_shard * shard = me != NULL ? NULL : my_shard(pool);
+    struct future_cache * cache = me != NULL ? &me->cache : &shard->cache;
+    enum thread_pool_priority prio = current_prio(me);
+    struct thread_pool_token * token = current_token(me);
+    int i;
+
+    if (n <= 0) {
+        return 0;
+    }
+
+    if (me == NULL) {
+        pthread_mutex_lock(&shard->lock);
+    }
+    for (i = 0; i < n; i++) {
+        if ((futures[i] = future_alloc(pool, cache)) == NULL) {
+            break;
         }
+        futures[i]->task = task;
+        futures[i]->data = data[i];
+        futures[i]->prio = prio;
+        futures[i]->token = token;
     }
 
-    #ifdef DEBUG
-        printf("Task completed, return result.\n");
-    #endif
-    
-    void * ret = f->result;
-    
-    pthread_mutex_unlock(&f->pool->lock);
+    if (i < n) {
+        printf("Error allocating future.\n");
+        while (i-- > 0) {
+            /* the lock, if any, is still held, so this is an owner free */
+            futures[i]->next_free = cache->free;
+            cache->free = futures[i];
+        }
+        if (me == NULL) {
+            pthread_mutex_unlock(&shard->lock);
+        }
+        return 0;
+    }
+    if (me == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+    }
 
-    return ret;
-}
+    if (pool->record_latency) {
+        unsigned long now = now_ns();
+        for (i = 0; i < n; i++) {
+            futures[i]->enqueued_ns = now;
+        }
+    }
 
-void future_free(struct future * f) {
-    pthread_cond_destroy(&f->done);
-    free(f);
+    atomic_fetch_add(&pool->npending[prio], n);
+    if (me != NULL) {
+        if (!deque_push_batch(&me->deques[prio], (void **) futures, n)) {
+            atomic_fetch_sub(&pool->npending[prio], n);
+            printf("Error growing worker deque.\n");
+            for (i = 0; i < n; i++) {
+                /* none of them was published, so this is an owner free */
+                futures[i]->next_free = cache->free;
+                cache->free = futures[i];
+            }
+            return 0;
+        }
+        for (i = 0; i < n && me->trace != NULL; i++) {
+            trace_instant(me, TRACE_SPAWN, futures[i], 0);
+        }
+    } else {
+        /* one CAS claims as many injection cells as there is room for,
+         * and one lock acquisition queues whatever did not fit */
+        i = pool->inject_capacity > 0
+            ? (int) mpmc_push_batch(&shard->queue[prio], (void **) futures, n) : 0;
+        if (i < n) {
+            int injected = i;
+            pthread_mutex_lock(&pool->lock);
+            for (; i < n; i++) {
+                list_push_back(&pool->global_queue[prio], &futures[i]->elem);
+            }
+            atomic_fetch_add(&pool->global_size[prio], n - injected);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+
+    notify_workers(pool, n);
+    return n;
 }
 
-/* goes through and checks all the queues, if all are empty then the thread should sleep */
-static bool sleeping(struct thread_pool * p) {
-    struct list_elem * wte;
-    for (wte = list_begin(&p->worker_threads); wte != list_end(&p->worker_threads); wte = list_next(wte)) {
-        struct worker *  worka = list_entry(wte, struct worker, elem);
+/* submit a job whose future lives in caller provided storage */
+struct future * thread_pool_submit_into(struct thread_pool * pool, struct future_storage * storage,
+                                        fork_join_task_t task, void * data) {
 
-        if (!list_empty(&worka->worker_queue)) {
-            return false;
-        }    
-    }
+    struct future * f = (struct future *) storage;
+    struct worker * me = current_worker(pool);
 
-    return list_empty(&p->global_queue) && list_empty(&w->worker_queue) && !p->shutdown;
+    f->task = task;
+    f->data = data;
+    f->pool = pool;
+    f->home = NULL;
+    f->prio = current_prio(me);
+    f->token = current_token(me);
+    f->cancelled = false;
+    atomic_init(&f->status, NOT_STARTED);
+    atomic_init(&f->conts, NULL);
+    atomic_init(&f->tombstone, 0);
+    return enqueue_future(pool, me, f) ? f : NULL;
 }
 
-/* goes through all worker threads and finds the first job available to steal */
-static struct list_elem * steal_task(struct thread_pool * p) {
-    
-    struct list_elem * wte;
-    for (wte = list_begin(&p->worker_threads); wte != list_end(&p->worker_threads); wte = list_next(wte)) {
-        struct worker *  worka = list_entry(wte, struct worker, elem);
+/* the part of a thread_pool_parallel_for() loop one task runs */
+struct parallel_for_range {
+    long begin;
+    long end;
+    thread_pool_range_fn body;
+    void * ctx;
+};
 
-        if (!list_empty(&worka->worker_queue)) {
-           return list_pop_back(&worka->worker_queue);
-        }    
+static void * parallel_for_task(struct thread_pool *, void *);
+
+/* splitting only pays off if our deque is empty, so a thief would find
+ * nothing, and some worker is actually looking for work or parked */
+static inline bool worth_splitting(struct thread_pool * pool, struct worker * me) {
+    return me != NULL && pool->nthreads > 1
+        && deque_size(&me->deques[me->prio]) == 0
+        && (atomic_load_explicit(&pool->nsearching, memory_order_relaxed) > 0
+            || atomic_load_explicit(&pool->idle.nwaiters, memory_order_relaxed) > 0);
+}
+
+/* lazy binary splitting: run the range chunk by chunk, and whenever it is
+ * worth splitting, offer the upper half to thieves and go on with the lower
+ * half. the upper half's future lives in our stack frame, we always join it. */
+static void parallel_for_range(struct thread_pool * pool, struct worker * me,
+                               struct parallel_for_range * r) {
+    long i = r->begin;
+    long chunk = PARALLEL_FOR_MIN_CHUNK;
+
+    while (i < r->end) {
+        if (r->end - i > 1 && worth_splitting(pool, me)) {
+            long mid = i + (r->end - i) / 2;
+            struct parallel_for_range upper = { mid, r->end, r->body, r->ctx };
+            struct future_storage storage;
+            struct future * f = thread_pool_submit_into(pool, &storage, parallel_for_task, &upper);
+            if (f != NULL) {
+                struct parallel_for_range lower = { i, mid, r->body, r->ctx };
+                parallel_for_range(pool, me, &lower);
+                future_get(f);
+                return;
+            }
+        }
+
+        long n = r->end - i < chunk ? r->end - i : chunk;
+        r->body(pool, i, i + n, r->ctx);
+        i += n;
+        if (chunk < PARALLEL_FOR_MAX_CHUNK) {
+            chunk *= 2;
+        }
+    }
+}
+
+static void * parallel_for_task(struct thread_pool * pool, void * data) {
+    parallel_for_range(pool, current_worker(pool), data);
+    return NULL;
+}
+
+/* run body over [begin, end), splitting the range only on demand */
+void thread_pool_parallel_for(struct thread_pool * pool, long begin, long end,
+                              thread_pool_range_fn body, void * ctx) {
+    if (begin >= end) {
+        return;
+    }
+
+    struct parallel_for_range r = { begin, end, body, ctx };
+    struct worker * me = current_worker(pool);
+    if (me != NULL) {
+        parallel_for_range(pool, me, &r);
+        return;
+    }
+
+    /* only workers run tasks, so hand the whole range to one of them. if
+     * that fails, we run it ourselves, without splitting */
+    struct future_storage storage;
+    struct future * f = thread_pool_submit_into(pool, &storage, parallel_for_task, &r);
+    if (f == NULL) {
+        parallel_for_range(pool, NULL, &r);
+        return;
+    }
+    future_get(f);
+}
+
+/* a thread_pool_parallel_reduce() in progress */
+struct reduce_state {
+    char * accs;                /* one accumulator per worker, 'stride' bytes apart */
+    size_t stride;
+    thread_pool_leaf_fn leaf;
+    void * ctx;
+};
+
+/* parallel_for body that folds a piece of the range into the running worker's accumulator */
+static void reduce_range(struct thread_pool * pool, long begin, long end, void * data) {
+    struct reduce_state * rs = data;
+    struct worker * me = current_worker(pool);
+    /* outside the pool, the loop runs on the calling thread alone, see
+     * thread_pool_parallel_for, so worker 0's accumulator is free */
+    int id = me != NULL ? me->id : 0;
+    rs->leaf(pool, begin, end, rs->accs + id * rs->stride, rs->ctx);
+}
+
+/* reduce [begin, end) into result. each accumulator sits on its own cache
+ * lines, so workers folding into them do not share any */
+bool thread_pool_parallel_reduce(struct thread_pool * pool, long begin, long end, size_t size,
+                                 thread_pool_identity_fn identity, thread_pool_leaf_fn leaf,
+                                 thread_pool_combine_fn combine, void * result, void * ctx) {
+    struct reduce_state rs;
+    int i;
+
+    rs.stride = (size + 63) & ~(size_t) 63;
+    if (posix_memalign((void **) &rs.accs, 64, rs.stride * pool->nthreads) != 0) {
+        printf("Error allocating accumulators.\n");
+        return false;
+    }
+    rs.leaf = leaf;
+    rs.ctx = ctx;
+    for (i = 0; i < pool->nthreads; i++) {
+        identity(rs.accs + i * rs.stride, ctx);
+    }
+
+    thread_pool_parallel_for(pool, begin, end, reduce_range, &rs);
+
+    identity(result, ctx);
+    for (i = 0; i < pool->nthreads; i++) {
+        combine(result, rs.accs + i * rs.stride, ctx);
+    }
+    free(rs.accs);
+    return true;
+}
+
+/* the shard of the calling thread, which is not a worker. threads are dealt
+ * out to shards round robin the first time they submit to any pool. */
+static __thread int shard_index = -1;
+static atomic_uint next_shard;
+
+static struct inject_shard * my_shard(struct thread_pool * pool) {
+    if (shard_index < 0) {
+        shard_index = atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % INJECT_SHARDS;
+    }
+    return &pool->shards[shard_index];
+}
+
+/* push f onto the shard's injection queue. false if there is none or it is full */
+static bool inject(struct thread_pool * pool, struct inject_shard * s, struct future * f) {
+    return pool->inject_capacity > 0 && mpmc_push(&s->queue[f->prio], f);
+}
+
+/* push a new future onto our own deque, or an injection queue if we are not a worker
+ * or pass me NULL. only the push onto a deque can fail */
+static bool enqueue_future(struct thread_pool * pool, struct worker * me, struct future * f) {
+    if (pool->record_latency) {
+        f->enqueued_ns = now_ns();
+    }
+
+    /* counted before it is visible, so npending never undercounts and a
+     * worker that sees it zero may safely go to sleep */
+    atomic_fetch_add(&pool->npending[f->prio], 1);
+
+    if (me != NULL) {
+        #ifdef DEBUG
+            printf("Received internal thread_pool_submit, pushing onto worker's deque\n");
+        #endif
+        if (!deque_push(&me->deques[f->prio], f)) {
+            atomic_fetch_sub(&pool->npending[f->prio], 1);
+            printf("Error growing worker deque.\n");
+            return false;
+        }
+        if (me->trace != NULL) {
+            trace_instant(me, TRACE_SPAWN, f, 0);
+        }
+        notify_workers(pool, 1);
+    } else {
+        #ifdef DEBUG
+            printf("Received external thread_pool_submit, pushing onto injection queue\n");
+        #endif
+        if (!inject(pool, my_shard(pool), f)) {
+            pthread_mutex_lock(&pool->lock);
+            list_push_back(&pool->global_queue[f->prio], &f->elem);
+            atomic_fetch_add(&pool->global_size[f->prio], 1);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        notify_workers(pool, 1);
+    }
+    return true;
+}
+
+static void futex_wait(atomic_int * addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_int * addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/* like futex_wait, but only futex_wake_bits calls whose bits overlap ours
+ * wake us. futex_wake wakes any waiter. */
+static void futex_wait_bits(atomic_int * addr, int val, unsigned bits) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, val, NULL, NULL, bits);
+}
+
+static void futex_wake_bits(atomic_int * addr, int n, unsigned bits) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_BITSET_PRIVATE, n, NULL, NULL, bits);
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static int ec_prepare_wait(struct eventcount * ec) {
+    atomic_fetch_add(&ec->nwaiters, 1);
+    return atomic_load(&ec->epoch);
+}
+
+static void ec_cancel_wait(struct eventcount * ec) {
+    atomic_fetch_sub(&ec->nwaiters, 1);
+}
+
+static void ec_commit_wait(struct eventcount * ec, int key, unsigned bits) {
+    while (atomic_load(&ec->epoch) == key) {
+        futex_wait_bits(&ec->epoch, key, bits);
+    }
+    atomic_fetch_sub(&ec->nwaiters, 1);
+}
+
+/* wake up to n waiters. the caller must have published its work first. */
+static void ec_notify(struct eventcount * ec, int n) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ec->nwaiters, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&ec->epoch, 1);
+        futex_wake(&ec->epoch, n);
+    }
+}
+
+/* wake the waiters that sleep with any of bits. others that have not
+ * committed yet see the new epoch and recheck for work instead of sleeping. */
+static void ec_notify_bits(struct eventcount * ec, unsigned bits) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ec->nwaiters, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&ec->epoch, 1);
+        futex_wake_bits(&ec->epoch, INT_MAX, bits);
+    }
+}
+
+/* futures queued at any priority */
+static inline long pending_total(struct thread_pool * pool, memory_order mo) {
+    long n = 0;
+    int p;
+    for (p = 0; p < THREAD_POOL_NUM_PRIOS; p++) {
+        n += atomic_load_explicit(&pool->npending[p], mo);
+    }
+    return n;
+}
+
+/* wake a parked worker after work was queued, but only if the work is not
+ * already covered by workers that are out looking for some. a searching
+ * worker that finds work calls us again, and one in idle_wait rechecks
+ * npending before it parks. a worker helping in future_get goes on to
+ * block instead, so it must call us itself if work is left when its
+ * search fails, or the wakeup skipped here is lost. */
+static void notify_workers(struct thread_pool * pool, int max) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->idle.nwaiters, memory_order_relaxed) == 0) {
+        return;
+    }
+
+    long surplus = pending_total(pool, memory_order_relaxed)
+                 - atomic_load_explicit(&pool->nsearching, memory_order_relaxed);
+    if (surplus > 0) {
+        ec_notify(&pool->idle, surplus < max ? surplus : max);
+    }
+}
+
+/* the worker has started or stopped looking for work on other workers */
+static void set_searching(struct thread_pool * pool, struct worker * me, bool searching) {
+    if (me->searching == searching) {
+        return;
+    }
+    me->searching = searching;
+    if (searching) {
+        atomic_fetch_add(&pool->nsearching, 1);
+    } else {
+        atomic_fetch_sub(&pool->nsearching, 1);
+    }
+}
+
+/* fiber mode. every task a worker finds in its run loop runs on a fiber of
+ * its own. a join in such a task runs the children at the bottom of the
+ * worker's own deque inline; if the joined future is still not done after
+ * that, the fiber suspends and the worker returns to its run loop to find
+ * other work. whoever completes the future puts the fiber on its home
+ * worker's resumable list, and the home worker switches back to it.
+ * fibers never move between workers, so thread-local state stays valid. */
+
+/* where every fiber starts, it runs one task after another */
+static void fiber_main(void) {
+    for (;;) {
+        struct worker * me = w;
+        struct task_fiber * fb = me->current;
+        run_future(me->pool, fb->future);
+        fb->done = true;
+        fiber_switch(&fb->fiber, &me->sched);
+    }
+}
+
+/* switch from the run loop to fb until its task finishes or suspends */
+static void enter_fiber(struct worker * me, struct task_fiber * fb) {
+    me->current = fb;
+    fiber_switch(&me->sched, &fb->fiber);
+    me->current = NULL;
+    if (fb->done) {
+        fb->next = me->free_fibers;
+        me->free_fibers = fb;
+    }
+}
+
+/* run f on a recycled or new fiber, or right here if no stack can be had */
+static void run_on_fiber(struct thread_pool * pool, struct worker * me, struct future * f) {
+    struct task_fiber * fb = me->free_fibers;
+
+    if (fb != NULL) {
+        me->free_fibers = fb->next;
+    } else {
+        fb = malloc(sizeof(struct task_fiber));
+        if (fb == NULL || !fiber_init(&fb->fiber, pool->fiber_stack_size, fiber_main)) {
+            printf("Error allocating fiber, running task on the worker stack.\n");
+            free(fb);
+            run_future(pool, f);
+            return;
+        }
+        fb->home = me;
+        fb->track = atomic_fetch_add_explicit(&pool->next_track, 1, memory_order_relaxed);
+        fb->next_all = me->all_fibers;
+        me->all_fibers = fb;
+    }
+    fb->future = f;
+    fb->done = false;
+    enter_fiber(me, fb);
+}
+
+/* busy time is credited to the innermost running task: a task that runs
+ * a nested one, or blocks in a join, stops its clock until it goes on.
+ * busy_pause() returns whether a task's clock was running. */
+static bool busy_pause(struct thread_pool * pool, struct worker * me) {
+    if (!pool->record_busy_time || me->busy_since == 0) {
+        return false;
+    }
+    STAT_ADD(me->stats.busy_ns, now_ns() - me->busy_since);
+    me->busy_since = 0;
+    return true;
+}
+
+static void busy_resume(struct thread_pool * pool, struct worker * me, bool busy) {
+    if (pool->record_busy_time && busy) {
+        me->busy_since = now_ns();
+    }
+}
+
+/* switch to every fiber whose join has completed. returns false if there was none */
+static bool resume_fibers(struct worker * me) {
+    struct task_fiber * fb = atomic_exchange_explicit(&me->resumable, NULL, memory_order_acquire);
+    if (fb == NULL) {
+        return false;
+    }
+    while (fb != NULL) {
+        struct task_fiber * next = fb->next;
+        enter_fiber(me, fb);
+        fb = next;
+    }
+    return true;
+}
+
+/* trigger of a suspended join: hand the fiber back to its home worker,
+ * waking it if it is parked. the trigger lives on the fiber's stack and
+ * must not be touched once the fiber is on the list. */
+static void fiber_fire(struct thread_pool * pool, struct future * t) {
+    struct task_fiber * fb = t->data;
+    struct worker * home = fb->home;
+
+    struct task_fiber * head = atomic_load_explicit(&home->resumable, memory_order_relaxed);
+    do {
+        fb->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&home->resumable, &head, fb,
+                                                    memory_order_release, memory_order_relaxed));
+
+    /* pairs with idle_wait, which sets parked before it rechecks resumable */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&home->parked, memory_order_relaxed)) {
+        ec_notify_bits(&pool->idle, home->wake_bit);
+    }
+}
+
+/* join f from a fiber: help with our own children, then suspend until f completes */
+static void fiber_join(struct thread_pool * pool, struct worker * me, struct future * f) {
+    while (atomic_load_explicit(&f->status, memory_order_acquire) != COMPLETED) {
+        struct future * t = pop_own(pool, me);
+        if (t != NULL) {
+            run_future(pool, t);
+            continue;
+        }
+
+        struct future trigger;
+        trigger.task = NULL;
+        trigger.fire = fiber_fire;
+        trigger.data = me->current;
+        if (!add_continuation(f, &trigger)) {
+            break;
+        }
+        /* f's completer resumes us through our home worker, which is this thread.
+         * the tasks it runs meanwhile change the current priority and token. */
+        enum thread_pool_priority prio = me->prio;
+        struct thread_pool_token * token = me->token;
+        bool busy = busy_pause(pool, me);
+        me->nsuspended++;
+        fiber_switch(&me->current->fiber, &me->sched);
+        me->nsuspended--;
+        busy_resume(pool, me, busy);
+        me->prio = prio;
+        me->token = token;
+    }
+}
+
+/* worker thread function */
+static void * working_thread(void * param) {
+    w = (struct worker *) param;
+    struct thread_pool * pool = w->pool;
+
+    /* wait for all worker threads to be created before workers start working */
+    pthread_barrier_wait(&pool->start_sync);
+
+    /* run loop */
+    while (!atomic_load_explicit(&pool->shutdown, memory_order_relaxed)) {
+
+        /* fibers whose join has completed go first, they hold on to a stack */
+        if (pool->fibers && resume_fibers(w)) {
+            continue;
+        }
+
+        /* first check worker's own deque, then check global queue,
+         * and finally steal from other workers if the first two
+         * are empty. */
+        struct future * f = find_task(pool, w);
+        if (f != NULL) {
+            if (pool->fibers) {
+                run_on_fiber(pool, w, f);
+            } else {
+                run_future(pool, f);
+            }
+            continue;
+        }
+
+        idle_wait(pool, w);
+    }
+
+    /* pool is shutting down. complete what is still queued as cancelled, so
+     * nobody waits for it forever and tombstones get freed. fibers suspended
+     * in a join still have to finish their tasks; they are resumed as the
+     * futures they wait for complete, wherever those run */
+    for (;;) {
+        if (pool->fibers && resume_fibers(w)) {
+            continue;
+        }
+        struct future * f = find_task(pool, w);
+        if (f != NULL) {
+            run_future(pool, f);
+        } else if (w->nsuspended > 0) {
+            sched_yield();
+        } else {
+            break;
+        }
+    }
+
+    #ifdef DEBUG
+        printf("Exiting thread %d\n", (int) w->tid);
+    #endif
+
+    pthread_exit(NULL);
+    return NULL;
+}
+
+static inline bool wait_over(struct thread_pool * pool, struct worker * me) {
+    return atomic_load_explicit(&pool->shutdown, memory_order_relaxed) || work_available(pool)
+        || atomic_load(&me->resumable) != NULL;
+}
+
+/* wait for work to show up or the pool to shut down. bursty fork/join
+ * phases would pay a futex sleep and wakeup every time a worker runs dry,
+ * so it first polls with pause, then with sched_yield, and only then parks. */
+static void idle_wait(struct thread_pool * pool, struct worker * me) {
+    unsigned long start;
+    int i;
+
+    /* while polling we will pick up new work ourselves, so we count as a
+     * searcher and submitters need not wake anybody */
+    set_searching(pool, me, true);
+
+    /* a phase with no budget reads no clock */
+    if (pool->spin_iterations > 0) {
+        start = now_ns();
+        for (i = 0; i < pool->spin_iterations && !wait_over(pool, me); i++) {
+            cpu_relax();
+        }
+        STAT_ADD(me->stats.spin_ns, now_ns() - start);
+        if (i < pool->spin_iterations) {
+            return;
+        }
+    }
+
+    if (pool->yield_iterations > 0) {
+        start = now_ns();
+        for (i = 0; i < pool->yield_iterations && !wait_over(pool, me); i++) {
+            sched_yield();
+        }
+        STAT_ADD(me->stats.yield_ns, now_ns() - start);
+        if (i < pool->yield_iterations) {
+            return;
+        }
+    }
+
+    /* park. we stop counting as a searcher first so submitters know to wake somebody */
+    set_searching(pool, me, false);
+    atomic_store(&me->parked, true);
+    int key = ec_prepare_wait(&pool->idle);
+    if (wait_over(pool, me)) {
+        ec_cancel_wait(&pool->idle);
+        atomic_store_explicit(&me->parked, false, memory_order_relaxed);
+        return;
+    }
+    #ifdef DEBUG
+        printf("No work, now sleeping.\n");
+    #endif
+    start = now_ns();
+    uint64_t park_start = me->trace != NULL ? trace_clock() : 0;
+    ec_commit_wait(&pool->idle, key, me->wake_bit);
+    atomic_store_explicit(&me->parked, false, memory_order_relaxed);
+    if (me->trace != NULL) {
+        trace_add(me->trace, TRACE_PARK, me->id, park_start, trace_clock(), 0, 0);
+    }
+    STAT_ADD(me->stats.park_ns, now_ns() - start);
+
+    /* a woken worker goes looking for the work it was woken for */
+    set_searching(pool, me, true);
+
+    #ifdef DEBUG
+        printf("Awoken worker thread: %d.\n", (int) me->tid);
+    #endif
+}
+
+/* move f from NOT_STARTED to IN_PROGRESS, keeping the waiters bit. only the
+ * thread that took f off its queue and future_cancel() race for this. */
+static bool claim_future(struct future * f) {
+    int s = atomic_load_explicit(&f->status, memory_order_relaxed);
+    do {
+        if (FUTURE_STATE(s) != NOT_STARTED) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&f->status, &s, IN_PROGRESS | (s & FUTURE_WAITERS),
+                                                    memory_order_acquire, memory_order_relaxed));
+    return true;
+}
+
+/* one more party is done with the cancelled future f, see TOMBSTONE_PARTIES */
+static void drop_tombstone(struct future * f) {
+    if (atomic_fetch_add_explicit(&f->tombstone, 1, memory_order_acq_rel) == TOMBSTONE_PARTIES - 1) {
+        future_release(f);
+    }
+}
+
+/* execute a future that was taken off a queue and notify any thread waiting on it.
+ * a future that was cancelled while queued is a tombstone and only dropped. one
+ * whose group was cancelled, or that is taken once the pool shuts down, is
+ * completed without running. */
+static void run_future(struct thread_pool * pool, struct future * f) {
+    if (!claim_future(f)) {
+        drop_tombstone(f);
+        return;
+    }
+
+    if (atomic_load_explicit(&pool->shutdown, memory_order_relaxed)
+        || (f->token != NULL && atomic_load_explicit(&f->token->cancelled, memory_order_relaxed))) {
+        f->cancelled = true;
+        complete_future(pool, f, NULL);
+        return;
+    }
+
+    /* only workers run futures. what the task spawns inherits its priority and token */
+    STAT_INC(w->stats.tasks);
+    enum thread_pool_priority prio = w->prio;
+    struct thread_pool_token * token = w->token;
+    w->prio = f->prio;
+    w->token = f->token;
+    unsigned long outer = 0;
+    if (pool->record_busy_time) {
+        unsigned long now = now_ns();
+        outer = w->busy_since;
+        if (outer != 0) {
+            STAT_ADD(w->stats.busy_ns, now - outer);
+        }
+        w->busy_since = now;
+    }
+    uint64_t start = w->trace != NULL ? trace_clock() : 0;
+    void * result = (f->task)(pool, f->data);
+    if (w->trace != NULL) {
+        /* a task may be suspended on its fiber, but it ends on the fiber it started on */
+        trace_add(w->trace, TRACE_TASK, trace_track(w), start, trace_clock(), (uintptr_t) f, f->prio);
+    }
+    if (pool->record_busy_time) {
+        /* the clock of the task we interrupted, if any, goes on */
+        unsigned long now = now_ns();
+        STAT_ADD(w->stats.busy_ns, now - w->busy_since);
+        w->busy_since = outer != 0 ? now : 0;
+    }
+    w->prio = prio;
+    w->token = token;
+    complete_future(pool, f, result);
+}
+
+/* complete f with a NULL result if its task has not started yet. f stays on its
+ * queue as a tombstone, which whoever takes it drops instead of running */
+bool future_cancel(struct future * f) {
+    /* futures in caller storage may be gone by the time their tombstone is
+     * taken, and those without a task are completed by their inputs */
+    if (f->home == NULL || f->task == NULL || !claim_future(f)) {
+        return false;
+    }
+    f->cancelled = true;
+    atomic_fetch_add_explicit(&f->tombstone, 1, memory_order_relaxed);
+    complete_future(f->pool, f, NULL);
+    return true;
+}
+
+/* whether f completed without its task having run */
+bool future_is_cancelled(struct future * f) {
+    return f->cancelled;
+}
+
+struct thread_pool_token * thread_pool_token_new(void) {
+    struct thread_pool_token * token = malloc(sizeof(struct thread_pool_token));
+    if (token == NULL) {
+        printf("Error allocating cancellation token.\n");
+        return NULL;
+    }
+    atomic_init(&token->cancelled, false);
+    return token;
+}
+
+/* tasks of the group that have not started yet will not run; running ones
+ * see it in thread_pool_is_cancelled() */
+void thread_pool_token_cancel(struct thread_pool_token * token) {
+    atomic_store_explicit(&token->cancelled, true, memory_order_relaxed);
+}
+
+void thread_pool_token_free(struct thread_pool_token * token) {
+    free(token);
+}
+
+/* submit a job belonging to the given group, as do all jobs it submits in turn */
+struct future * thread_pool_submit_with_token(struct thread_pool * pool, struct thread_pool_token * token,
+                                              fork_join_task_t task, void * data) {
+    struct worker * me = current_worker(pool);
+    struct future * f = new_future(pool, me, task, data);
+
+    if (f == NULL) {
+        return NULL;
+    }
+    f->token = token;
+    return submit_future(pool, me, f);
+}
+
+/* whether the calling task should give up: its group was cancelled or the pool is shutting down */
+bool thread_pool_is_cancelled(struct thread_pool * pool) {
+    if (atomic_load_explicit(&pool->shutdown, memory_order_relaxed)) {
+        return true;
+    }
+    struct worker * me = current_worker(pool);
+    return me != NULL && me->token != NULL
+        && atomic_load_explicit(&me->token->cancelled, memory_order_relaxed);
+}
+
+/* publish the result of f, wake its waiters and schedule its continuations */
+static void complete_future(struct thread_pool * pool, struct future * f, void * result) {
+    f->result = result;
+
+    /* close the continuation list before we publish COMPLETED, so that every
+     * continuation is either on the list we take or scheduled by future_then */
+    struct future * c = atomic_exchange_explicit(&f->conts, CONTS_CLOSED, memory_order_acq_rel);
+
+    /* a waiter may return and free the future as soon as it sees COMPLETED.
+     * waking a recycled or freed address is harmless, futex waiters always
+     * recheck their condition. */
+    int old = atomic_exchange_explicit(&f->status, COMPLETED, memory_order_acq_rel);
+    if (old & FUTURE_WAITERS) {
+        futex_wake(&f->status, INT_MAX);
+    }
+
+    /* continuations go onto our own deque, where we will likely pick them up
+     * next. if it cannot grow, they go where outside submissions go, which
+     * always has room, since somebody is waiting for them */
+    while (c != NULL) {
+        struct future * next = c->next_cont;
+        if (c->task == NULL) {
+            c->fire(pool, c);
+        } else if (!enqueue_future(pool, current_worker(pool), c)) {
+            enqueue_future(pool, NULL, c);
+        }
+        c = next;
+    }
+}
+
+/* block until the future is completed, spinning briefly before sleeping */
+static void future_wait(struct future * f) {
+    int i;
+    for (i = 0; i < FUTURE_SPIN_COUNT; i++) {
+        if (atomic_load_explicit(&f->status, memory_order_acquire) == COMPLETED) {
+            return;
+        }
+        cpu_relax();
+    }
+
+    int s = atomic_load_explicit(&f->status, memory_order_acquire);
+    while (FUTURE_STATE(s) != COMPLETED) {
+        if (!(s & FUTURE_WAITERS)) {
+            if (!atomic_compare_exchange_weak_explicit(&f->status, &s, s | FUTURE_WAITERS,
+                                                       memory_order_acquire, memory_order_acquire)) {
+                continue;
+            }
+            s |= FUTURE_WAITERS;
+        }
+        futex_wait(&f->status, s);
+        s = atomic_load_explicit(&f->status, memory_order_acquire);
+    }
+}
+
+/* returns a future once it has finished executing */
+void * future_get(struct future * f) {
+
+    #ifdef DEBUG
+        printf("future_get called.\n");
+    #endif
+
+    struct thread_pool * pool = f->pool;
+    struct worker * me = current_worker(pool);
+
+    /* workers help by executing other tasks until this one is done.
+     * the future is most likely at the bottom of our own deque. */
+    if (me != NULL && me->current != NULL) {
+        fiber_join(pool, me, f);
+    } else if (me != NULL) {
+        while (atomic_load_explicit(&f->status, memory_order_acquire) != COMPLETED) {
+            /* in fiber mode, this is a task that got no fiber. f may wait on
+             * fibers of ours, so we resume them rather than block */
+            if (pool->fibers) {
+                bool busy = busy_pause(pool, me);
+                bool resumed = resume_fibers(me);
+                busy_resume(pool, me, busy);
+                if (resumed) {
+                    continue;
+                }
+            }
+            struct future * t = find_task(pool, me);
+            if (t == NULL) {
+                /* a submit that ran while we were stealing may have left
+                 * its wakeup to us; we are about to block, so pass it on */
+                if (work_available(pool)) {
+                    notify_workers(pool, 1);
+                }
+                if (pool->fibers) {
+                    sched_yield();
+                    continue;
+                }
+                break;
+            }
+            run_future(pool, t);
+        }
+    }
+
+    #ifdef DEBUG
+        printf("Task already started, waiting for completion.\n");
+    #endif
+    /* a task that blocks here stops its busy clock meanwhile */
+    bool busy = me != NULL && atomic_load_explicit(&f->status, memory_order_relaxed) != COMPLETED
+                && busy_pause(pool, me);
+    future_wait(f);
+    busy_resume(pool, me, busy);
+
+    #ifdef DEBUG
+        printf("Task completed, return result.\n");
+    #endif
+
+    return f->result;
+}
+
+/* free f, unless it was cancelled while queued and its tombstone is still there */
+void future_free(struct future * f) {
+    if (f->home == NULL) {
+        return;
+    }
+    if (atomic_load_explicit(&f->tombstone, memory_order_relaxed) != 0) {
+        drop_tombstone(f);
+        return;
+    }
+    future_release(f);
+}
+
+/* return the future to the cache it came from */
+static void future_release(struct future * f) {
+    struct future_cache * cache = f->home;
+
+    if (w != NULL && cache == &w->cache) {
+        f->next_free = cache->free;
+        cache->free = f;
+        return;
+    }
+
+    struct future * head = atomic_load_explicit(&cache->remote_free, memory_order_relaxed);
+    do {
+        f->next_free = head;
+    } while (!atomic_compare_exchange_weak_explicit(&cache->remote_free, &head, f,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+/* number of futures the pool has carved out of slabs, which never shrink */
+size_t thread_pool_slab_futures(struct thread_pool * pool) {
+    return atomic_load(&pool->slab_futures);
+}
+
+static void future_cache_init(struct future_cache * cache) {
+    cache->free = NULL;
+    atomic_init(&cache->remote_free, NULL);
+    cache->slabs = NULL;
+}
+
+static void future_cache_destroy(struct future_cache * cache) {
+    while (cache->slabs != NULL) {
+        struct future_slab * slab = cache->slabs;
+        cache->slabs = slab->next;
+        free(slab);
+    }
+}
+
+/* take a future from the cache. only the owner of the cache may call
+ * this, for the cache of an injection shard that means whoever holds its lock. */
+static struct future * future_alloc(struct thread_pool * pool, struct future_cache * cache) {
+    struct future * f = cache->free;
+
+    if (f == NULL) {
+        /* reclaim everything other threads have returned */
+        f = atomic_exchange_explicit(&cache->remote_free, NULL, memory_order_acquire);
+    }
+
+    if (f == NULL) {
+        struct future_slab * slab;
+        if ((posix_memalign((void **) &slab, 64, sizeof(struct future_slab))) != 0) {
+            return NULL;
+        }
+
+        int i;
+        for (i = 0; i < FUTURES_PER_SLAB; i++) {
+            struct future * sf = &slab->futures[i];
+            sf->pool = pool;
+            sf->home = cache;
+            sf->next_free = i + 1 < FUTURES_PER_SLAB ? sf + 1 : NULL;
+        }
+        slab->next = cache->slabs;
+        cache->slabs = slab;
+        atomic_fetch_add_explicit(&pool->slab_futures, FUTURES_PER_SLAB, memory_order_relaxed);
+        f = &slab->futures[0];
+    }
+
+    cache->free = f->next_free;
+    f->cancelled = false;
+    atomic_init(&f->status, NOT_STARTED);
+    atomic_init(&f->conts, NULL);
+    atomic_init(&f->tombstone, 0);
+    return f;
+}
+
+/* takes an external submission of the given priority, if any. the injection
+ * queues are polled in batches, starting at a different shard for every
+ * worker; we keep one future of a batch and push the rest onto our own deque,
+ * oldest at the bottom, where we find them next and idle workers can steal
+ * them. */
+static struct future * take_global(struct thread_pool * pool, struct worker * me, int prio) {
+    struct future * f = NULL;
+    int i;
+    for (i = 0; i < INJECT_SHARDS && pool->inject_capacity > 0; i++) {
+        struct mpmc * q = &pool->shards[(me->id + i) % INJECT_SHARDS].queue[prio];
+        void * batch[INJECT_BATCH];
+        size_t n = mpmc_pop_batch(q, batch, INJECT_BATCH);
+        if (n == 0) {
+            continue;
+        }
+
+        size_t j;
+        for (j = 1; j < n - j; j++) {
+            void * t = batch[j];
+            batch[j] = batch[n - j];
+            batch[n - j] = t;
+        }
+        if (n > 1 && !deque_push_batch(&me->deques[prio], batch + 1, n - 1)) {
+            printf("Error growing worker deque.\n");
+            pthread_mutex_lock(&pool->lock);
+            for (j = 1; j < n; j++) {
+                list_push_back(&pool->global_queue[prio], &((struct future *) batch[j])->elem);
+            }
+            atomic_fetch_add(&pool->global_size[prio], n - 1);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        return batch[0];
+    }
+
+    if (atomic_load_explicit(&pool->global_size[prio], memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        if (!list_empty(&pool->global_queue[prio])) {
+            f = list_entry(list_pop_front(&pool->global_queue[prio]), struct future, elem);
+            atomic_fetch_sub(&pool->global_size[prio], 1);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return f;
+}
+
+/* account for a future we took off a queue */
+static void took_future(struct thread_pool * pool, struct worker * me, struct future * f) {
+    atomic_fetch_sub(&pool->npending[f->prio], 1);
+
+    if (pool->record_latency) {
+        struct latency_stats * ls = &me->stats.latency[f->prio];
+        unsigned long ns = now_ns() - f->enqueued_ns;
+        int b = 63 - __builtin_clzl(ns | 1);
+        STAT_INC(ls->count);
+        STAT_ADD(ls->total_ns, ns);
+        STAT_INC(ls->hist[b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1]);
+        if (ns > atomic_load_explicit(&ls->max_ns, memory_order_relaxed)) {
+            atomic_store_explicit(&ls->max_ns, ns, memory_order_relaxed);
+        }
+    }
+}
+
+/* pops the most urgent future from our own deques */
+static struct future * pop_own(struct thread_pool * pool, struct worker * me) {
+    int p;
+    for (p = 0; p < THREAD_POOL_NUM_PRIOS; p++) {
+        struct future * f = deque_pop(&me->deques[p]);
+        if (f != NULL) {
+            STAT_INC(me->stats.local_pops);
+            took_future(pool, me, f);
+            return f;
+        }
     }
     return NULL;
 }
+
+/* takes a future from our own deque, the global queue, or another worker.
+ * all of them are searched for a more urgent future before any is searched
+ * for a less urgent one, but priorities with nothing queued are skipped. */
+static struct future * find_task(struct thread_pool * pool, struct worker * me) {
+    struct future * f = NULL;
+    int p;
+    for (p = 0; p < THREAD_POOL_NUM_PRIOS && f == NULL; p++) {
+        if (atomic_load_explicit(&pool->npending[p], memory_order_relaxed) == 0) {
+            continue;
+        }
+        if ((f = deque_pop(&me->deques[p])) != NULL) {
+            STAT_INC(me->stats.local_pops);
+        } else if ((f = take_global(pool, me, p)) != NULL) {
+            STAT_INC(me->stats.global_pops);
+        } else {
+            set_searching(pool, me, true);
+            f = steal_task(pool, me, p);
+        }
+    }
+    if (f == NULL) {
+        /* a worker that gives up, or goes on to block in future_get, must
+         * not be counted as somebody who will pick up new work */
+        set_searching(pool, me, false);
+        return NULL;
+    }
+
+    took_future(pool, me, f);
+    /* a searcher that found work hands off to a parked worker if there
+     * is still more work queued than workers looking for it */
+    if (me->searching) {
+        set_searching(pool, me, false);
+        notify_workers(pool, 1);
+    }
+    return f;
+}
+
+/* if no future is queued anywhere the calling worker should sleep */
+static inline bool work_available(struct thread_pool * p) {
+    return pending_total(p, memory_order_seq_cst) > 0;
+}
+
+static inline uint32_t xorshift32(uint32_t * state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* steal from the top of the victim's deque, retrying while we lose races for it */
+static struct future * steal_from(struct worker * me, struct worker * victim, int prio) {
+    void * f;
+    do {
+        STAT_INC(me->stats.steal_attempts);
+        f = deque_steal(&victim->deques[prio]);
+    } while (f == DEQUE_ABORT);
+
+    if (f != NULL) {
+        STAT_INC(me->stats.steals);
+        if (me->trace != NULL) {
+            trace_instant(me, TRACE_STEAL, f, victim->id);
+        }
+        if (victim->node != me->node) {
+            STAT_INC(me->stats.remote_steals);
+        }
+        me->last_victim = victim->id;
+    }
+    return f;
+}
+
+/* probe the given victims once each, starting at a random one so that
+ * thieves do not all pile onto the same victim */
+static struct future * steal_sweep(struct thread_pool * p, struct worker * me, int prio,
+                                   int * victims, int n, int skip) {
+    if (n == 0) {
+        return NULL;
+    }
+
+    int start = xorshift32(&me->rng) % n;
+    int i;
+    for (i = 0; i < n; i++) {
+        int v = victims[(start + i) % n];
+        if (v == skip) {
+            continue;
+        }
+        struct future * f = steal_from(me, &p->workers[v], prio);
+        if (f != NULL) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+/* steals a job from another worker. the victim we last stole from is tried
+ * first, since it likely still has work, then the other workers on our NUMA
+ * node. tasks stolen across nodes drag their data over the interconnect, so
+ * other nodes are only probed once remote_steal_rounds local sweeps in a row
+ * came up empty. only deques of the given priority are looked at. */
+static struct future * steal_task(struct thread_pool * p, struct worker * me, int prio) {
+    struct future * f;
+    bool go_remote = me->failed_local_rounds >= p->remote_steal_rounds;
+
+    int last = me->last_victim;
+    if (last >= 0 && (go_remote || p->workers[last].node == me->node)) {
+        if ((f = steal_from(me, &p->workers[last], prio)) != NULL) {
+            return f;
+        }
+        me->last_victim = -1;
+    }
+
+    if ((f = steal_sweep(p, me, prio, me->local_victims, me->nlocal, last)) != NULL) {
+        me->failed_local_rounds = 0;
+        return f;
+    }
+
+    if (!go_remote) {
+        me->failed_local_rounds++;
+        return NULL;
+    }
+
+    if ((f = steal_sweep(p, me, prio, me->remote_victims, me->nremote, last)) != NULL) {
+        me->failed_local_rounds = 0;
+    }
+    return f;
+}
+
+/* add the counters of every worker of pool to s */
+static void add_stats(struct thread_pool_stats * s, struct thread_pool * pool) {
+    int i;
+    for (i = 0; i < pool->nthreads; i++) {
+        struct worker_stats * ws = &pool->workers[i].stats;
+        s->tasks += atomic_load_explicit(&ws->tasks, memory_order_relaxed);
+        s->local_pops += atomic_load_explicit(&ws->local_pops, memory_order_relaxed);
+        s->global_pops += atomic_load_explicit(&ws->global_pops, memory_order_relaxed);
+        s->steal_attempts += atomic_load_explicit(&ws->steal_attempts, memory_order_relaxed);
+        s->steals += atomic_load_explicit(&ws->steals, memory_order_relaxed);
+        s->remote_steals += atomic_load_explicit(&ws->remote_steals, memory_order_relaxed);
+        s->busy_ns += atomic_load_explicit(&ws->busy_ns, memory_order_relaxed);
+        s->spin_ns += atomic_load_explicit(&ws->spin_ns, memory_order_relaxed);
+        s->yield_ns += atomic_load_explicit(&ws->yield_ns, memory_order_relaxed);
+        s->park_ns += atomic_load_explicit(&ws->park_ns, memory_order_relaxed);
+    }
+}
+
+/* scheduler counters summed over all workers */
+void thread_pool_get_stats(struct thread_pool * pool, struct thread_pool_stats * s) {
+    *s = (struct thread_pool_stats) {0};
+    add_stats(s, pool);
+}
+
+/* scheduler counters summed over every pool this process has created */
+void thread_pool_get_process_stats(struct thread_pool_stats * s) {
+    pthread_mutex_lock(&live_pools_lock);
+    *s = destroyed_stats;
+    struct thread_pool * pool;
+    for (pool = live_pools; pool != NULL; pool = pool->next_live) {
+        add_stats(s, pool);
+    }
+    pthread_mutex_unlock(&live_pools_lock);
+}
+
+/* total time all workers spent in each phase of waiting for work */
+void thread_pool_get_idle_stats(struct thread_pool * pool, unsigned long * spin_ns,
+                                unsigned long * yield_ns, unsigned long * park_ns) {
+    *spin_ns = *yield_ns = *park_ns = 0;
+    int i;
+    for (i = 0; i < pool->nthreads; i++) {
+        *spin_ns += atomic_load_explicit(&pool->workers[i].stats.spin_ns, memory_order_relaxed);
+        *yield_ns += atomic_load_explicit(&pool->workers[i].stats.yield_ns, memory_order_relaxed);
+        *park_ns += atomic_load_explicit(&pool->workers[i].stats.park_ns, memory_order_relaxed);
+    }
+}
+
+/* queue wait of one priority's futures, merged over all workers */
+void thread_pool_get_latency_stats(struct thread_pool * pool, enum thread_pool_priority prio,
+                                   struct thread_pool_latency * out) {
+    unsigned long total = 0;
+    unsigned long hist[LATENCY_BUCKETS] = {0};
+    int i, b;
+
+    *out = (struct thread_pool_latency) {0};
+    for (i = 0; i < pool->nthreads; i++) {
+        struct latency_stats * ls = &pool->workers[i].stats.latency[prio];
+        unsigned long max = atomic_load_explicit(&ls->max_ns, memory_order_relaxed);
+        out->count += atomic_load_explicit(&ls->count, memory_order_relaxed);
+        total += atomic_load_explicit(&ls->total_ns, memory_order_relaxed);
+        if (max > out->max_ns) {
+            out->max_ns = max;
+        }
+        for (b = 0; b < LATENCY_BUCKETS; b++) {
+            hist[b] += atomic_load_explicit(&ls->hist[b], memory_order_relaxed);
+        }
+    }
+    if (out->count == 0) {
+        return;
+    }
+    out->mean_ns = total / out->count;
+
+    /* bucket b holds waits in [2^b, 2^(b+1)) */
+    unsigned long seen = 0;
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += hist[b];
+        unsigned long bound = (2UL << b) < out->max_ns ? (2UL << b) : out->max_ns;
+        if (out->p50_ns == 0 && seen * 2 >= out->count) {
+            out->p50_ns = bound;
+        }
+        if (out->p99_ns == 0 && seen * 100 >= out->count * 99) {
+            out->p99_ns = bound;
+            break;
+        }
+    }
+}
+
+/* number of NUMA nodes steal statistics are kept for */
+int thread_pool_get_num_nodes(struct thread_pool * pool) {
+    return pool->nnodes;
+}
+
+/* steals by the workers on one node, split into steals from the same node and from others */
+void thread_pool_get_node_steal_stats(struct thread_pool * pool, int node,
+                                      unsigned long * local_steals, unsigned long * remote_steals) {
+    *local_steals = *remote_steals = 0;
+    int i;
+    for (i = 0; i < pool->nthreads; i++) {
+        struct worker * wt = &pool->workers[i];
+        if (wt->node != node) {
+            continue;
+        }
+        unsigned long steals = atomic_load_explicit(&wt->stats.steals, memory_order_relaxed);
+        unsigned long remote = atomic_load_explicit(&wt->stats.remote_steals, memory_order_relaxed);
+        *local_steals += steals - remote;
+        *remote_steals += remote;
+    }
+}
+
+/* total steal attempts and successful steals over all workers */
+void thread_pool_get_steal_stats(struct thread_pool * pool, unsigned long * attempts, unsigned long * successes) {
+    *attempts = *successes = 0;
+    int i;
+    for (i = 0; i < pool->nthreads; i++) {
+        *attempts += atomic_load_explicit(&pool->workers[i].stats.steal_attempts, memory_order_relaxed);
+        *successes += atomic_load_explicit(&pool->workers[i].stats.steals, memory_order_relaxed);
+    }
+}
@@ -3,6 +3,11 @@
  *
  * A work-stealing, fork-join thread pool.
  */
+#ifndef __THREADPOOL_H
+#define __THREADPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
 
 /* 
  * Opaque forward declarations. The actual definitions of these 
@@ -10,14 +15,128 @@
  */
 struct thread_pool;
 struct future;
+struct thread_pool_token;
+
+/*
+ * Storage for a future provided by the caller, see
+ * thread_pool_submit_into().  Its contents are private to
+ * threadpool.c; only its size and alignment are public.
+ */
+#define FUTURE_STORAGE_SIZE 128
+struct future_storage {
+    union {
+        char bytes[FUTURE_STORAGE_SIZE];
+        max_align_t align;
+    } opaque;
+};
 
 /* Create a new thread pool with no more than n threads. */
 struct thread_pool * thread_pool_new(int nthreads);
 
+/* How workers are pinned to CPUs, see struct thread_pool_options. */
+enum thread_pool_placement {
+    THREAD_POOL_PLACE_NONE,         /* leave placement to the scheduler */
+    THREAD_POOL_PLACE_COMPACT,      /* fill hyperthreads, then cores, then packages */
+    THREAD_POOL_PLACE_SCATTER,      /* spread over packages, then cores */
+    THREAD_POOL_PLACE_PHYSICAL_CORE /* one worker per physical core */
+};
+
+/* How urgent a task is, see thread_pool_submit_prio(). */
+enum thread_pool_priority {
+    THREAD_POOL_PRIO_HIGH,
+    THREAD_POOL_PRIO_NORMAL,        /* that of thread_pool_submit() from outside the pool */
+    THREAD_POOL_PRIO_LOW
+};
+#define THREAD_POOL_NUM_PRIOS 3
+
+/*
+ * Pool configuration for thread_pool_new_with_options().
+ * Initialize with thread_pool_options_init() and then override
+ * individual fields, so that fields added later get defaults.
+ */
+struct thread_pool_options {
+    int nthreads;
+
+    /* A worker that runs out of work polls for new work this many
+     * times with a pause instruction, then this many times with
+     * sched_yield(), before it parks in the kernel.  Larger values
+     * trade CPU time for lower wakeup latency; 0 and 0 park at once. */
+    int spin_iterations;
+    int yield_iterations;
+
+    /* Pin each worker to a CPU chosen by 'placement' from the CPUs
+     * this process may run on, read from /sys/devices/system/cpu.
+     * If 'cpus' is not NULL, worker i is instead pinned to
+     * cpus[i % ncpus].  Workers wrap around if there are more of
+     * them than CPUs.  A worker whose CPU is offline or outside
+     * the process's affinity mask runs unpinned, and
+     * thread_pool_worker_cpu() reports -1 for it.  Default
+     * THREAD_POOL_PLACE_NONE. */
+    enum thread_pool_placement placement;
+    const int *cpus;
+    int ncpus;
+
+    /* Pinned workers are grouped by the NUMA node of their CPU and
+     * steal from workers on their own node first.  They steal from
+     * other nodes only after this many consecutive sweeps over
+     * their own node found nothing. */
+    int remote_steal_rounds;
+
+    /* Run every task on a fiber, a stack of its own of
+     * 'fiber_stack_size' bytes.  A task that joins a future that is
+     * still running elsewhere then suspends its fiber, and the worker
+     * goes on to run other tasks instead of waiting; the fiber is
+     * resumed on the same worker once the future completes.  Tasks
+     * must not rely on their stack beyond 'fiber_stack_size'.
+     * Default false. */
+    bool fibers;
+    size_t fiber_stack_size;
+
+    /* Time how long every future waits between being submitted and
+     * being started, per priority, for
+     * thread_pool_get_latency_stats().  Costs two clock reads per
+     * task.  Default false. */
+    bool record_latency;
+
+    /* Time how long workers spend running tasks, for 'busy_ns' in
+     * struct thread_pool_stats.  A task that runs a nested task or
+     * blocks in future_get() is not counted meanwhile.  Costs two
+     * clock reads per task.  Default false. */
+    bool record_busy_time;
+
+    /* Threads that are not workers of the pool submit through
+     * lock-free injection queues, spread over a fixed number of
+     * shards; each thread sticks to one shard.  Each queue holds
+     * this many futures, rounded up to a power of two, beyond which
+     * submissions fall back to a queue protected by a lock.  0
+     * always uses the locked queue.  Default 256. */
+    size_t inject_capacity;
+
+    /* Record when every task ran, was spawned and was stolen, and
+     * when workers parked, and write the events to 'trace_file' as
+     * Chrome Trace Event JSON, which Perfetto and chrome://tracing
+     * open, when the pool is destroyed.  Each worker keeps the last
+     * 'trace_capacity' events, rounded up to a power of two.  If
+     * 'trace_file' is NULL, the THREADPOOL_TRACE environment
+     * variable names the file, if it is set.  Tracing off costs a
+     * branch per event.  Default NULL and 65536. */
+    const char *trace_file;
+    size_t trace_capacity;
+};
+
+/* Fill in the default options for a pool of nthreads threads. */
+void thread_pool_options_init(struct thread_pool_options *, int nthreads);
+
+/* Create a new thread pool as described by 'opts'. */
+struct thread_pool * thread_pool_new_with_options(const struct thread_pool_options *opts);
+
 /* 
  * Shutdown this thread pool in an orderly fashion.  
  * Tasks that have been submitted but not executed may or
- * may not be executed.
+ * may not be executed.  Once shutdown has begun, workers complete
+ * the tasks they take off the queues as cancelled instead of
+ * running them, and thread_pool_is_cancelled() returns true, so
+ * recursive tasks that poll it return quickly.
  *
  * Deallocate the thread pool object before returning. 
  */
@@ -42,13 +161,178 @@ typedef void * (* fork_join_task_t) (struct thread_pool *pool, void * data);
  * 'task' - the task to be submitted.
  * 'data' - data to be passed to the task's function
  *
- * Returns a future representing this computation.
+ * Returns a future representing this computation, or NULL if
+ * the task could not be queued.
  */
 struct future * thread_pool_submit(
         struct thread_pool *pool, 
         fork_join_task_t task, 
         void * data);
 
+/*
+ * Like thread_pool_submit(), but with priority 'prio'.  Every
+ * priority has queues of its own, and workers look for a task of
+ * higher priority in their own queue, the pool's, and other
+ * workers' before they look for one of lower priority.  A running
+ * task is not preempted.  Tasks submitted from within a task, by
+ * any function, get the priority of the submitting task; tasks
+ * submitted from outside the pool get THREAD_POOL_PRIO_NORMAL.
+ */
+struct future * thread_pool_submit_prio(
+        struct thread_pool *pool,
+        enum thread_pool_priority prio,
+        fork_join_task_t task,
+        void * data);
+
+/*
+ * A cancellation token groups tasks that can be cancelled
+ * together.  Tasks submitted with thread_pool_submit_with_token(),
+ * and all tasks they submit in turn, belong to the token's group.
+ * After thread_pool_token_cancel(), tasks of the group that have
+ * not started are completed as cancelled when a worker takes them,
+ * and running ones see thread_pool_is_cancelled() return true.
+ * The token may be freed once all futures of its group have
+ * completed.
+ *
+ * thread_pool_token_new() returns NULL if it cannot allocate.
+ */
+struct thread_pool_token * thread_pool_token_new(void);
+void thread_pool_token_cancel(struct thread_pool_token *);
+void thread_pool_token_free(struct thread_pool_token *);
+
+struct future * thread_pool_submit_with_token(
+        struct thread_pool *pool,
+        struct thread_pool_token *token,
+        fork_join_task_t task,
+        void * data);
+
+/* Whether the calling task's group was cancelled or the pool is
+ * shutting down.  Tasks that run long or spawn much work should
+ * poll this and return early; the results of futures they join
+ * may then be NULL.  Outside of a task, only the latter counts. */
+bool thread_pool_is_cancelled(struct thread_pool *pool);
+
+/*
+ * Submit 'n' instances of 'task' at once, the i-th one with data
+ * 'data[i]'.  Compared to n calls to thread_pool_submit(), the
+ * tasks are enqueued with one synchronization and workers are
+ * woken with a single wakeup.  From outside the pool that is one
+ * CAS on an injection queue, plus one lock acquisition for the
+ * tasks the queue has no room for.  The future of the i-th task is
+ * stored in 'futures[i]', and each must be joined and freed
+ * individually.
+ *
+ * Returns the number of tasks submitted, n on success and 0 if
+ * none could be submitted.
+ */
+int thread_pool_submit_batch(
+        struct thread_pool *pool,
+        int n,
+        fork_join_task_t task,
+        void * data[],
+        struct future * futures[]);
+
+/*
+ * Like thread_pool_submit(), but the future is placed in 'storage'
+ * instead of being allocated.  'storage' must stay valid until
+ * future_get() on the returned future has returned, for instance
+ * by living in the stack frame of a task that always joins its
+ * children.  Such a future needs no future_free().  If NULL is
+ * returned the task was not queued and 'storage' is unused.
+ */
+struct future * thread_pool_submit_into(
+        struct thread_pool *pool,
+        struct future_storage *storage,
+        fork_join_task_t task,
+        void * data);
+
+/* A loop body for thread_pool_parallel_for(), run for the
+ * iterations [begin, end) of the loop with the 'ctx' that was
+ * passed to thread_pool_parallel_for(). */
+typedef void (* thread_pool_range_fn) (struct thread_pool *pool,
+        long begin, long end, void * ctx);
+
+/*
+ * Run 'body' over the iterations [begin, end) in parallel and
+ * return once all of them have run.  The range is split in half
+ * only when a worker is looking for work, so there is no grain
+ * size to pick: a busy pool runs the loop almost serially, an
+ * idle one spreads it over all workers.  'body' may be called
+ * any number of times on disjoint subranges, concurrently.
+ *
+ * May be called from inside a task or from outside the pool.  If
+ * the loop cannot be handed to a worker, an outside caller runs
+ * it on its own thread.
+ */
+void thread_pool_parallel_for(
+        struct thread_pool *pool,
+        long begin, long end,
+        thread_pool_range_fn body,
+        void * ctx);
+
+/* Callbacks for thread_pool_parallel_reduce().  Accumulators are
+ * 'size' bytes of memory whose contents are up to the caller.
+ * 'identity' initializes one to the neutral element, 'leaf' folds
+ * the iterations [begin, end) into one, and 'combine' folds 'src'
+ * into 'dst'. */
+typedef void (* thread_pool_identity_fn) (void * acc, void * ctx);
+typedef void (* thread_pool_leaf_fn) (struct thread_pool *pool,
+        long begin, long end, void * acc, void * ctx);
+typedef void (* thread_pool_combine_fn) (void * dst, const void * src, void * ctx);
+
+/*
+ * Reduce the iterations [begin, end) into 'result', which must
+ * point to 'size' bytes.  The range is split as in
+ * thread_pool_parallel_for(), but instead of returning partial
+ * results up a tree of futures, every worker folds the pieces it
+ * runs into its own accumulator, and the accumulators are combined
+ * once at the end.  'combine' must therefore be associative and
+ * commutative.  'leaf' must not wait on futures, since the worker
+ * may then run another piece of the same reduction into the same
+ * accumulator.
+ *
+ * May be called from inside a task or from outside the pool.
+ * Returns false if the accumulators could not be allocated.
+ */
+bool thread_pool_parallel_reduce(
+        struct thread_pool *pool,
+        long begin, long end,
+        size_t size,
+        thread_pool_identity_fn identity,
+        thread_pool_leaf_fn leaf,
+        thread_pool_combine_fn combine,
+        void * result,
+        void * ctx);
+
+/*
+ * Schedule 'task' to run with 'data' once the task of future 'f'
+ * has completed, and return a future for it.  No thread waits in
+ * the meantime: the worker that completes 'f' schedules the
+ * continuation on itself, or if 'f' has already completed, it is
+ * submitted right away.  The continuation may call future_get(f)
+ * to obtain f's result without blocking.  'f' must not be freed
+ * before the continuation has run.  Both futures must be freed.
+ *
+ * Returns NULL if the continuation could not be allocated.
+ */
+struct future * future_then(struct future *f, fork_join_task_t task, void * data);
+
+/*
+ * Return a future that completes once all of the 'n' futures in
+ * 'futures' have completed, or once the first of them has.  No
+ * task is run to track them: each input's completion counts down
+ * an atomic counter, so a thread that waits on the returned future
+ * wakes up once rather than once per input.  future_get() on it
+ * returns NULL for future_when_all() and the index of the first
+ * future to complete for future_when_any().  The returned future
+ * must be freed; the inputs must not be freed before they have
+ * completed.
+ *
+ * Returns NULL if 'n' is not positive or on allocation failure.
+ */
+struct future * future_when_all(struct future **futures, int n);
+struct future * future_when_any(struct future **futures, int n);
+
 /* Make sure that the thread pool has completed the execution
  * of the fork join task this future represents.
  *
@@ -56,6 +340,95 @@ struct future * thread_pool_submit(
  */
 void * future_get(struct future *);
 
-/* Deallocate this future.  Must be called after future_get() */
+/*
+ * Cancel 'f' if its task has not started yet, and return whether
+ * it was cancelled.  A cancelled future completes at once with a
+ * NULL result, its continuations are scheduled, and its task will
+ * not run.  It stays on its queue as a tombstone that the worker
+ * which takes it discards, so cancelling takes constant time and
+ * future_free() may be called right away.  Futures from
+ * thread_pool_submit_into(), future_when_all() and
+ * future_when_any() cannot be cancelled.
+ */
+bool future_cancel(struct future *f);
+
+/* Whether 'f' completed without its task running, because it, its
+ * group, or the pool was cancelled.  Only valid after
+ * future_get(). */
+bool future_is_cancelled(struct future *f);
+
+/* Deallocate this future.  Must be called after future_get()
+ * and before the pool that created it is destroyed.  Does nothing
+ * for futures returned by thread_pool_submit_into(). */
 void future_free(struct future *);
 
+/* The CPU worker number 'worker' was pinned to, or -1 if it is
+ * not pinned. */
+int thread_pool_worker_cpu(struct thread_pool *, int worker);
+
+/* Number of futures the pool has carved out of its slabs, which
+ * are only released when the pool is destroyed.  Freed futures are
+ * recycled, but each worker and shard has a cache of its own, so
+ * this may exceed the number of futures that were live at once. */
+size_t thread_pool_slab_futures(struct thread_pool *);
+
+/* Number of times workers tried to steal from another worker's
+ * deque, and how many of those attempts returned a task. */
+void thread_pool_get_steal_stats(struct thread_pool *,
+        unsigned long *attempts, unsigned long *successes);
+
+/* Number of NUMA nodes, counted as the highest node any worker was
+ * pinned to plus one.  Unpinned workers all count as node 0. */
+int thread_pool_get_num_nodes(struct thread_pool *);
+
+/* Successful steals by the workers on 'node', split into steals
+ * from workers on the same node and from workers on other nodes. */
+void thread_pool_get_node_steal_stats(struct thread_pool *, int node,
+        unsigned long *local_steals, unsigned long *remote_steals);
+
+/* Nanoseconds workers have spent, summed over all workers, polling
+ * with pause, polling with sched_yield(), and parked while waiting
+ * for work. */
+void thread_pool_get_idle_stats(struct thread_pool *,
+        unsigned long *spin_ns, unsigned long *yield_ns, unsigned long *park_ns);
+
+/* What the workers of a pool have done, summed over all of them.
+ * Every worker counts its own, without atomic operations, so the
+ * counters of a running pool may be slightly out of date. */
+struct thread_pool_stats {
+    unsigned long tasks;            /* tasks run, not counting cancelled ones */
+    unsigned long local_pops;       /* futures taken from the worker's own deque */
+    unsigned long global_pops;      /* futures taken from the queues of external submissions */
+    unsigned long steal_attempts;
+    unsigned long steals;
+    unsigned long remote_steals;    /* steals from a worker on another NUMA node */
+    unsigned long busy_ns;          /* time spent running tasks, 0 unless
+                                     * the pool has record_busy_time */
+    unsigned long spin_ns;          /* time spent waiting for work, see */
+    unsigned long yield_ns;         /* thread_pool_get_idle_stats() */
+    unsigned long park_ns;
+};
+
+void thread_pool_get_stats(struct thread_pool *, struct thread_pool_stats *);
+
+/* The same, summed over every pool the process has created,
+ * including those already destroyed. */
+void thread_pool_get_process_stats(struct thread_pool_stats *);
+
+/* Queue wait of the tasks of one priority, in nanoseconds from
+ * submission until a worker took them.  The percentiles are upper
+ * bounds, read off a histogram with power-of-two buckets. */
+struct thread_pool_latency {
+    unsigned long count;
+    unsigned long mean_ns;
+    unsigned long max_ns;
+    unsigned long p50_ns;
+    unsigned long p99_ns;
+};
+
+/* Queue wait statistics of the tasks of priority 'prio' taken so
+ * far.  All zero unless the pool was created with record_latency. */
+void thread_pool_get_latency_stats(struct thread_pool *,
+        enum thread_pool_priority prio, struct thread_pool_latency *);
+
+#endif /* threadpool.h */
@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <sys/resource.h>
 
+#include "threadpool.h"
 #include "threadpool_lib.h"
 
 // http://www.guyrutenberg.com/2007/09/22/profiling-code-using-clock_gettime/
@@ -77,6 +78,24 @@ static void print_rusage_as_json(FILE *output, struct rusage *usage)
     );
 }
 
+/* scheduler counters of all pools the benchmark used */
+static void print_pool_stats_as_json(FILE *output)
+{
+    struct thread_pool_stats s;
+    thread_pool_get_process_stats(&s);
+    fprintf(output, ", \"tasks\" : %lu, \"local_pops\" : %lu, \"global_pops\" : %lu"
+                    ", \"steal_attempts\" : %lu, \"steals\" : %lu, \"remote_steals\" : %lu"
+                    ", \"busy_time\" : %lu.%09lu, \"spin_time\" : %lu.%09lu"
+                    ", \"yield_time\" : %lu.%09lu, \"park_time\" : %lu.%09lu",
+        s.tasks, s.local_pops, s.global_pops,
+        s.steal_attempts, s.steals, s.remote_steals,
+        s.busy_ns / 1000000000, s.busy_ns % 1000000000,
+        s.spin_ns / 1000000000, s.spin_ns % 1000000000,
+        s.yield_ns / 1000000000, s.yield_ns % 1000000000,
+        s.park_ns / 1000000000, s.park_ns % 1000000000
+    );
+}
+
 static void print_rusage_to_human(FILE *output, struct rusage *usage)
 {
     fprintf(output, "user time: %ld.%06lds\nsystem time: %ld.%06lds\n",
@@ -136,6 +155,7 @@ void report_benchmark_results(struct benchmark_data *bdata)
     fprintf(f, "{");
     print_rusage_as_json(f, &bdata->rdiff);
     fprintf(f, ", \"realtime\" : %ld.%06ld", bdata->diff.tv_sec, bdata->diff.tv_usec);
+    print_pool_stats_as_json(f);
     fprintf(f, "}");
     fclose(f);
 }
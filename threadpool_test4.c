@@ -0,0 +1,142 @@
+/*
+ * Fork/Join Framework 
+ *
+ * Test 4.
+ *
+ * Tests batch submission, both from outside the pool and
+ * from within a task.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "threadpool.h"
+#include "threadpool_lib.h"
+#define DEFAULT_THREADS 1
+
+/* Data to be passed to callable. */
+struct arg2 {
+    uintptr_t a;
+    uintptr_t b;
+};
+
+/* 
+ * A FJ task that multiplies 2 numbers. 
+ */
+static void *
+multiplier_task(struct thread_pool *pool, struct arg2 * data)
+{
+    return (void *)(data->a * data->b);
+}
+
+#define NTASKS 200
+
+/* 
+ * A FJ task that submits a batch of multiplier tasks and sums their results. 
+ */
+static void *
+batch_task(struct thread_pool *pool, struct arg2 * data)
+{
+    struct arg2 args[NTASKS];
+    void *argp[NTASKS];
+    struct future *f[NTASKS];
+    int i;
+    for (i = 0; i < NTASKS; i++) {
+        args[i].a = i;
+        args[i].b = data->a;
+        argp[i] = &args[i];
+    }
+
+    if (thread_pool_submit_batch(pool, NTASKS, (fork_join_task_t) multiplier_task, argp, f) != NTASKS) {
+        fprintf(stderr, "Internal batch submission failed\n");
+        abort();
+    }
+
+    uintptr_t sum = 0;
+    for (i = 0; i < NTASKS; i++) {
+        sum += (uintptr_t) future_get(f[i]);
+        future_free(f[i]);
+    }
+    return (void *) sum;
+}
+
+static int
+run_test(int nthreads)
+{
+    struct benchmark_data * bdata = start_benchmark();
+    struct thread_pool * threadpool = thread_pool_new(nthreads);
+   
+    struct future *f[NTASKS];
+    struct arg2 args[NTASKS];
+    void *argp[NTASKS];
+    int i;
+    for (i = 0; i < NTASKS; i++) {
+        args[i].a = i;
+        args[i].b = i+1;
+        argp[i] = &args[i];
+    }
+
+    if (thread_pool_submit_batch(threadpool, NTASKS, (fork_join_task_t) batch_task, argp, f) != NTASKS) {
+        fprintf(stderr, "External batch submission failed\n");
+        abort();
+    }
+
+    bool success = true;
+    for (i = 0; i < NTASKS; i++) {
+        uintptr_t ssum = (uintptr_t) future_get(f[i]);
+        future_free(f[i]);
+        /* sum of j * i for j in 0..NTASKS-1 */
+        if (ssum != (uintptr_t) i * (NTASKS - 1) * NTASKS / 2)
+            success = false;
+    }
+    thread_pool_shutdown_and_destroy(threadpool);
+
+    stop_benchmark(bdata);
+
+    // consistency check
+    if (!success) {
+        fprintf(stderr, "Wrong result\n");
+        abort();
+    }
+
+    report_benchmark_results(bdata);
+    printf("Test successful.\n");
+    free(bdata);
+    return 0;
+}
+
+/**********************************************************************************/
+
+static void
+usage(char *av0, int exvalue)
+{
+    fprintf(stderr, "Usage: %s [-n <n>]\n"
+                    " -n number of threads in pool, default %d\n"
+                    , av0, DEFAULT_THREADS);
+    exit(exvalue);
+}
+
+int 
+main(int ac, char *av[]) 
+{
+    int c, nthreads = DEFAULT_THREADS;
+    while ((c = getopt(ac, av, "n:h")) != EOF) {
+        switch (c) {
+        case 'n':
+            nthreads = atoi(optarg);
+            break;
+        case 'h':
+            usage(av[0], EXIT_SUCCESS);
+        }
+    }
+
+    return run_test(nthreads);
+}
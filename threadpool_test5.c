@@ -0,0 +1,172 @@
+/*
+ * Fork/Join Framework 
+ *
+ * Test 5.
+ *
+ * Tests continuations and the when_all/when_any combinators, both
+ * from outside the pool and from within a task.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "threadpool.h"
+#include "threadpool_lib.h"
+#define DEFAULT_THREADS 1
+
+/* One link of a chain of continuations. */
+struct link {
+    struct future *prev;
+    uintptr_t add;
+};
+
+/* 
+ * A FJ task that returns its argument. 
+ */
+static void *
+value_task(struct thread_pool *pool, void * data)
+{
+    return data;
+}
+
+/* 
+ * A continuation that adds to the result of the future it continues. 
+ */
+static void *
+add_task(struct thread_pool *pool, struct link * l)
+{
+    return (void *)((uintptr_t) future_get(l->prev) + l->add);
+}
+
+#define NLINKS 500
+#define NFANOUT 20
+
+/*
+ * Build a chain of NLINKS continuations that each add 1, and
+ * NFANOUT continuations of the first future that add their index.
+ * Returns the chain's result, or 0 if any fanned out continuation
+ * got a wrong result.
+ */
+static uintptr_t
+run_chain(struct thread_pool *pool, uintptr_t start)
+{
+    struct link links[NLINKS], fan[NFANOUT];
+    struct future *f[NLINKS + 1], *g[NFANOUT];
+    int i;
+
+    f[0] = thread_pool_submit(pool, value_task, (void *) start);
+    for (i = 0; i < NFANOUT; i++) {
+        fan[i].prev = f[0];
+        fan[i].add = i;
+        g[i] = future_then(f[0], (fork_join_task_t) add_task, &fan[i]);
+    }
+    for (i = 0; i < NLINKS; i++) {
+        links[i].prev = f[i];
+        links[i].add = 1;
+        f[i + 1] = future_then(f[i], (fork_join_task_t) add_task, &links[i]);
+        if (f[i + 1] == NULL) {
+            fprintf(stderr, "future_then failed\n");
+            abort();
+        }
+    }
+
+    /* the fan must be complete once when_all is, and the first one
+     * reported by when_any must be complete as well */
+    struct future *any = future_when_any(g, NFANOUT);
+    struct future *all = future_when_all(g, NFANOUT);
+    uintptr_t result = (uintptr_t) future_get(f[NLINKS]);
+    intptr_t first = (intptr_t) future_get(any);
+    if (first < 0 || first >= NFANOUT || (uintptr_t) future_get(g[first]) != start + first)
+        result = 0;
+    future_get(all);
+    future_free(any);
+    future_free(all);
+    for (i = 0; i < NFANOUT; i++) {
+        if ((uintptr_t) future_get(g[i]) != start + i)
+            result = 0;
+        future_free(g[i]);
+    }
+    for (i = 0; i <= NLINKS; i++)
+        future_free(f[i]);
+    return result;
+}
+
+/* 
+ * A FJ task that builds a chain from within the pool. 
+ */
+static void *
+chain_task(struct thread_pool *pool, void * data)
+{
+    return (void *) run_chain(pool, (uintptr_t) data);
+}
+
+#define NTASKS 50
+
+static int
+run_test(int nthreads)
+{
+    struct benchmark_data * bdata = start_benchmark();
+    struct thread_pool * threadpool = thread_pool_new(nthreads);
+
+    bool success = run_chain(threadpool, 7) == 7 + NLINKS;
+
+    struct future *f[NTASKS];
+    int i;
+    for (i = 0; i < NTASKS; i++)
+        f[i] = thread_pool_submit(threadpool, chain_task, (void *)(uintptr_t) (i + 1));
+    for (i = 0; i < NTASKS; i++) {
+        if ((uintptr_t) future_get(f[i]) != i + 1 + NLINKS)
+            success = false;
+        future_free(f[i]);
+    }
+    thread_pool_shutdown_and_destroy(threadpool);
+
+    stop_benchmark(bdata);
+
+    // consistency check
+    if (!success) {
+        fprintf(stderr, "Wrong result\n");
+        abort();
+    }
+
+    report_benchmark_results(bdata);
+    printf("Test successful.\n");
+    free(bdata);
+    return 0;
+}
+
+/**********************************************************************************/
+
+static void
+usage(char *av0, int exvalue)
+{
+    fprintf(stderr, "Usage: %s [-n <n>]\n"
+                    " -n number of threads in pool, default %d\n"
+                    , av0, DEFAULT_THREADS);
+    exit(exvalue);
+}
+
+int 
+main(int ac, char *av[]) 
+{
+    int c, nthreads = DEFAULT_THREADS;
+    while ((c = getopt(ac, av, "n:h")) != EOF) {
+        switch (c) {
+        case 'n':
+            nthreads = atoi(optarg);
+            break;
+        case 'h':
+            usage(av[0], EXIT_SUCCESS);
+        }
+    }
+
+    return run_test(nthreads);
+}
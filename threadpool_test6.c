@@ -0,0 +1,245 @@
+/*
+ * Fork/Join Framework
+ *
+ * Test 6.
+ *
+ * Tests cancellation: future_cancel() on queued futures, from
+ * outside the pool and from within a task, and cancellation tokens
+ * that stop a group of tasks.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "threadpool.h"
+#include "threadpool_lib.h"
+#define DEFAULT_THREADS 1
+
+#define NTASKS 200
+
+static atomic_int nran;
+
+/* holds every worker until the tasks under test are queued */
+static atomic_int nblocked;
+static atomic_bool release;
+
+static void *
+blocker_task(struct thread_pool *pool, void * data)
+{
+    atomic_fetch_add(&nblocked, 1);
+    while (!atomic_load(&release))
+        sched_yield();
+    return NULL;
+}
+
+static void
+block_workers(struct thread_pool *pool, int nthreads, struct future **blockers)
+{
+    int i;
+    atomic_store(&nblocked, 0);
+    atomic_store(&release, false);
+    for (i = 0; i < nthreads; i++)
+        blockers[i] = thread_pool_submit(pool, blocker_task, NULL);
+    while (atomic_load(&nblocked) < nthreads)
+        sched_yield();
+}
+
+static void
+unblock_workers(int nthreads, struct future **blockers)
+{
+    int i;
+    atomic_store(&release, true);
+    for (i = 0; i < nthreads; i++) {
+        future_get(blockers[i]);
+        future_free(blockers[i]);
+    }
+}
+
+static void *
+counted_task(struct thread_pool *pool, void * data)
+{
+    atomic_fetch_add(&nran, 1);
+    return data;
+}
+
+/*
+ * A FJ task that spawns children, cancels every other one before
+ * anybody could take it, and joins the rest.
+ */
+static void *
+cancelling_task(struct thread_pool *pool, void * data)
+{
+    struct future *f[NTASKS];
+    uintptr_t i, sum = 0;
+    for (i = 0; i < NTASKS; i++)
+        f[i] = thread_pool_submit(pool, counted_task, (void *) (i + 1));
+    /* the most recently pushed children are at the bottom of our
+     * deque, where no thief looks first, but thieves may still have
+     * taken some of them */
+    for (i = 0; i < NTASKS; i += 2) {
+        if (future_cancel(f[i]))
+            future_free(f[i]);
+        else {
+            sum += (uintptr_t) future_get(f[i]);
+            future_free(f[i]);
+        }
+    }
+    for (i = 1; i < NTASKS; i += 2) {
+        sum += (uintptr_t) future_get(f[i]);
+        future_free(f[i]);
+    }
+    return (void *) sum;
+}
+
+/*
+ * A FJ task that keeps spawning copies of itself until its group is
+ * cancelled.
+ */
+static void *
+endless_task(struct thread_pool *pool, void * data)
+{
+    uintptr_t depth = (uintptr_t) data;
+    atomic_fetch_add(&nran, 1);
+    if (thread_pool_is_cancelled(pool))
+        return NULL;
+    sched_yield();
+    struct future *left = thread_pool_submit(pool, endless_task, (void *) (depth + 1));
+    struct future *right = thread_pool_submit(pool, endless_task, (void *) (depth + 1));
+    future_get(left);
+    future_get(right);
+    future_free(left);
+    future_free(right);
+    return NULL;
+}
+
+static int
+run_test(int nthreads)
+{
+    struct benchmark_data * bdata = start_benchmark();
+    struct thread_pool * threadpool = thread_pool_new(nthreads);
+    struct future **blockers = malloc(sizeof(*blockers) * nthreads);
+    struct future *f[NTASKS];
+    bool success = true;
+    uintptr_t i;
+
+    /* cancel every other queued future; free half of the cancelled
+     * ones without joining them */
+    block_workers(threadpool, nthreads, blockers);
+    atomic_store(&nran, 0);
+    for (i = 0; i < NTASKS; i++)
+        f[i] = thread_pool_submit(threadpool, counted_task, (void *) (i + 1));
+    for (i = 0; i < NTASKS; i += 2) {
+        if (!future_cancel(f[i]))
+            success = false;
+        if (i % 4 == 0) {
+            future_free(f[i]);
+            f[i] = NULL;
+        }
+    }
+    unblock_workers(nthreads, blockers);
+    for (i = 0; i < NTASKS; i++) {
+        if (f[i] == NULL)
+            continue;
+        void *r = future_get(f[i]);
+        bool cancelled = i % 2 == 0;
+        if (future_is_cancelled(f[i]) != cancelled || r != (cancelled ? NULL : (void *) (i + 1)))
+            success = false;
+        if (future_cancel(f[i]))
+            success = false;
+        future_free(f[i]);
+    }
+    if (atomic_load(&nran) != NTASKS / 2)
+        success = false;
+
+    /* cancel from within a task, where children sit in a worker's deque */
+    struct future *c = thread_pool_submit(threadpool, cancelling_task, NULL);
+    uintptr_t sum = (uintptr_t) future_get(c);
+    future_free(c);
+    if (sum < NTASKS / 2 * (NTASKS / 2 + 1) || sum > NTASKS * (NTASKS + 1) / 2)
+        success = false;
+
+    /* a cancelled token stops tasks of its group that have not started */
+    struct thread_pool_token *token = thread_pool_token_new();
+    block_workers(threadpool, nthreads, blockers);
+    atomic_store(&nran, 0);
+    for (i = 0; i < NTASKS; i++)
+        f[i] = thread_pool_submit_with_token(threadpool, token, counted_task, (void *) (i + 1));
+    thread_pool_token_cancel(token);
+    unblock_workers(nthreads, blockers);
+    for (i = 0; i < NTASKS; i++) {
+        if (future_get(f[i]) != NULL || !future_is_cancelled(f[i]))
+            success = false;
+        future_free(f[i]);
+    }
+    if (atomic_load(&nran) != 0)
+        success = false;
+    thread_pool_token_free(token);
+
+    /* and makes running tasks of its group give up */
+    token = thread_pool_token_new();
+    atomic_store(&nran, 0);
+    c = thread_pool_submit_with_token(threadpool, token, endless_task, (void *) 0);
+    while (atomic_load(&nran) < 1000)
+        sched_yield();
+    thread_pool_token_cancel(token);
+    future_get(c);
+    future_free(c);
+    thread_pool_token_free(token);
+
+    /* shutting down stops tasks that are still running */
+    atomic_store(&nran, 0);
+    thread_pool_submit(threadpool, endless_task, (void *) 0);
+    while (atomic_load(&nran) < 1000)
+        sched_yield();
+    thread_pool_shutdown_and_destroy(threadpool);
+
+    stop_benchmark(bdata);
+
+    // consistency check
+    if (!success) {
+        fprintf(stderr, "Wrong result\n");
+        abort();
+    }
+
+    report_benchmark_results(bdata);
+    printf("Test successful.\n");
+    free(bdata);
+    free(blockers);
+    return 0;
+}
+
+/**********************************************************************************/
+
+static void
+usage(char *av0, int exvalue)
+{
+    fprintf(stderr, "Usage: %s [-n <n>]\n"
+                    " -n number of threads in pool, default %d\n"
+                    , av0, DEFAULT_THREADS);
+    exit(exvalue);
+}
+
+int
+main(int ac, char *av[])
+{
+    int c, nthreads = DEFAULT_THREADS;
+    while ((c = getopt(ac, av, "n:h")) != EOF) {
+        switch (c) {
+        case 'n':
+            nthreads = atoi(optarg);
+            break;
+        case 'h':
+            usage(av[0], EXIT_SUCCESS);
+        }
+    }
+
+    return run_test(nthreads);
+}
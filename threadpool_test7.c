@@ -0,0 +1,213 @@
+/*
+ * Fork/Join Framework
+ *
+ * Test 7.
+ *
+ * Tests fiber mode: a join on a future that runs elsewhere suspends
+ * the joining task, its worker goes on with other work, and the task
+ * resumes on the same worker once the future completes, also when the
+ * pool is shut down while tasks are suspended.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "threadpool.h"
+#include "threadpool_lib.h"
+#define DEFAULT_THREADS 3
+
+/* how long to wait for something that takes microseconds with fibers */
+#define TIMEOUT_SEC 5
+
+/* every worker but one runs a gate task, which holds it until its
+ * gate is opened or the pool shuts down */
+static atomic_int nstarted;
+static atomic_bool *open_gate;
+
+static void *
+gate_task(struct thread_pool *pool, void * data)
+{
+    uintptr_t i = (uintptr_t) data;
+    atomic_fetch_add(&nstarted, 1);
+    while (!atomic_load(&open_gate[i]) && !thread_pool_is_cancelled(pool))
+        sched_yield();
+    return (void *) (i + 1);
+}
+
+/* A task that joins 'wait', and what it saw. */
+struct joiner {
+    struct future *wait;
+    atomic_bool joining;
+    atomic_bool done;
+    uintptr_t result;
+    bool same_thread;
+};
+
+static void *
+joiner_task(struct thread_pool *pool, struct joiner * j)
+{
+    pthread_t before = pthread_self();
+    atomic_store(&j->joining, true);
+    j->result = (uintptr_t) future_get(j->wait);
+    j->same_thread = pthread_equal(before, pthread_self());
+    atomic_store(&j->done, true);
+    return NULL;
+}
+
+/* Return true if *flag became set within TIMEOUT_SEC seconds. */
+static bool
+wait_for(atomic_bool *flag)
+{
+    time_t start = time(NULL);
+    while (!atomic_load(flag)) {
+        if (time(NULL) - start > TIMEOUT_SEC)
+            return false;
+        sched_yield();
+    }
+    return true;
+}
+
+/* Submit a gate task for each of nthreads - 1 workers and wait
+ * until all of them run, so one worker is left for the joiners. */
+static void
+close_gates(struct thread_pool *pool, int nthreads, struct future **gates)
+{
+    int i;
+    atomic_store(&nstarted, 0);
+    for (i = 0; i < nthreads - 1; i++) {
+        atomic_store(&open_gate[i], false);
+        gates[i] = thread_pool_submit(pool, gate_task, (void *) (uintptr_t) i);
+    }
+    while (atomic_load(&nstarted) < nthreads - 1)
+        sched_yield();
+}
+
+static void
+start_joiner(struct thread_pool *pool, struct joiner *j, struct future *wait, struct future **f)
+{
+    j->wait = wait;
+    atomic_init(&j->joining, false);
+    atomic_init(&j->done, false);
+    j->result = 0;
+    j->same_thread = false;
+    *f = thread_pool_submit(pool, (fork_join_task_t) joiner_task, j);
+}
+
+static struct thread_pool *
+new_fiber_pool(int nthreads)
+{
+    struct thread_pool_options opts;
+    thread_pool_options_init(&opts, nthreads);
+    opts.fibers = true;
+    return thread_pool_new_with_options(&opts);
+}
+
+static int
+run_test(int nthreads)
+{
+    struct benchmark_data * bdata = start_benchmark();
+    struct thread_pool * threadpool = new_fiber_pool(nthreads);
+    struct future **gates = malloc(sizeof(*gates) * (nthreads - 1));
+    struct joiner a, c;
+    struct future *fa, *fc;
+    bool success = true;
+    int i;
+
+    open_gate = malloc(sizeof(*open_gate) * (nthreads - 1));
+
+    /* a joins gate 0 on the one free worker. c can only run on that
+     * worker once a has suspended, and joins gate 1. with a still on
+     * the worker's stack, opening gate 0 would not let a finish
+     * before c does; with fibers a resumes on its own. */
+    close_gates(threadpool, nthreads, gates);
+    start_joiner(threadpool, &a, gates[0], &fa);
+    if (!wait_for(&a.joining))
+        success = false;
+    start_joiner(threadpool, &c, gates[1], &fc);
+    if (!wait_for(&c.joining))
+        success = false;
+    atomic_store(&open_gate[0], true);
+    if (!wait_for(&a.done) || atomic_load(&c.done))
+        success = false;
+    for (i = 0; i < nthreads - 1; i++)
+        atomic_store(&open_gate[i], true);
+    future_get(fa);
+    future_get(fc);
+    if (a.result != 1 || c.result != 2 || !a.same_thread || !c.same_thread)
+        success = false;
+    future_free(fa);
+    future_free(fc);
+    for (i = 0; i < nthreads - 1; i++) {
+        future_get(gates[i]);
+        future_free(gates[i]);
+    }
+
+    /* shut down while a and c are suspended. the gates see the pool
+     * shutting down and return, and a and c must still be resumed
+     * and finish before the workers exit. their futures die with
+     * the pool. */
+    close_gates(threadpool, nthreads, gates);
+    start_joiner(threadpool, &a, gates[0], &fa);
+    if (!wait_for(&a.joining))
+        success = false;
+    start_joiner(threadpool, &c, gates[1], &fc);
+    if (!wait_for(&c.joining))
+        success = false;
+    thread_pool_shutdown_and_destroy(threadpool);
+    if (!atomic_load(&a.done) || !atomic_load(&c.done)
+        || a.result != 1 || c.result != 2 || !a.same_thread || !c.same_thread)
+        success = false;
+
+    stop_benchmark(bdata);
+
+    // consistency check
+    if (!success) {
+        fprintf(stderr, "Wrong result\n");
+        abort();
+    }
+
+    report_benchmark_results(bdata);
+    printf("Test successful.\n");
+    free(bdata);
+    free(gates);
+    free(open_gate);
+    return 0;
+}
+
+/**********************************************************************************/
+
+static void
+usage(char *av0, int exvalue)
+{
+    fprintf(stderr, "Usage: %s [-n <n>]\n"
+                    " -n number of threads in pool, at least 3, default %d\n"
+                    , av0, DEFAULT_THREADS);
+    exit(exvalue);
+}
+
+int
+main(int ac, char *av[])
+{
+    int c, nthreads = DEFAULT_THREADS;
+    while ((c = getopt(ac, av, "n:h")) != EOF) {
+        switch (c) {
+        case 'n':
+            nthreads = atoi(optarg);
+            break;
+        case 'h':
+            usage(av[0], EXIT_SUCCESS);
+        }
+    }
+    if (nthreads < 3)
+        usage(av[0], EXIT_FAILURE);
+
+    return run_test(nthreads);
+}
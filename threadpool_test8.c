@@ -0,0 +1,421 @@
+/*
+ * Fork/Join Framework
+ *
+ * Test 8.
+ *
+ * Tests tracing: a pool with a trace file must write valid Chrome
+ * Trace Event JSON, with a named track per worker and a task slice
+ * for every task that ran.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "threadpool.h"
+#include "threadpool_lib.h"
+#define DEFAULT_THREADS 4
+
+#define NTASKS 100
+#define NCHILDREN 4
+
+static atomic_int nran;
+
+static void *
+child_task(struct thread_pool *pool, void * data)
+{
+    atomic_fetch_add(&nran, 1);
+    return data;
+}
+
+/*
+ * A FJ task that spawns NCHILDREN children and joins them.
+ */
+static void *
+parent_task(struct thread_pool *pool, void * data)
+{
+    struct future *f[NCHILDREN];
+    uintptr_t i, sum = 0;
+    atomic_fetch_add(&nran, 1);
+    for (i = 0; i < NCHILDREN; i++)
+        f[i] = thread_pool_submit(pool, child_task, (void *) i);
+    for (i = 0; i < NCHILDREN; i++) {
+        sum += (uintptr_t) future_get(f[i]);
+        future_free(f[i]);
+    }
+    return (void *) sum;
+}
+
+/**********************************************************************************/
+
+/* What the trace says. */
+struct trace_summary {
+    int nworkers;
+    int ntracks;            /* thread_name records */
+    bool *named;            /* named[i]: track i is named "worker i" */
+    int ntasks;             /* task slices */
+    int bad_events;         /* events missing a field or on no worker's track */
+};
+
+/* The fields of one event we look at. */
+struct event {
+    char name[32];
+    char ph[4];
+    char arg_name[32];      /* args.name of metadata records */
+    double tid;
+    bool has_tid, has_ts, has_dur;
+};
+
+/* A JSON parser just good enough to check syntax and pick out
+ * event fields.  Every function returns false on malformed input. */
+struct parser {
+    const char *p;
+};
+
+static bool parse_value(struct parser *ps, struct event *ev, const char *key);
+
+static void
+skip_ws(struct parser *ps)
+{
+    while (*ps->p == ' ' || *ps->p == '\n' || *ps->p == '\t' || *ps->p == '\r')
+        ps->p++;
+}
+
+static bool
+parse_string(struct parser *ps, char *out, size_t size)
+{
+    size_t n = 0;
+    if (*ps->p++ != '"')
+        return false;
+    while (*ps->p != '"') {
+        if (*ps->p == '\0' || (unsigned char) *ps->p < 0x20)
+            return false;
+        if (*ps->p == '\\' && *++ps->p == '\0')
+            return false;
+        if (out != NULL && n + 1 < size)
+            out[n++] = *ps->p;
+        ps->p++;
+    }
+    ps->p++;
+    if (out != NULL)
+        out[n] = '\0';
+    return true;
+}
+
+static bool
+parse_number(struct parser *ps, double *out)
+{
+    char *end;
+    /* strtod also takes hex, inf and nan, which JSON does not */
+    if (*ps->p != '-' && (*ps->p < '0' || *ps->p > '9'))
+        return false;
+    double d = strtod(ps->p, &end);
+    if (end == ps->p)
+        return false;
+    ps->p = end;
+    if (out != NULL)
+        *out = d;
+    return true;
+}
+
+/* An object.  If 'ev' is not NULL, its fields are recorded in it,
+ * and the name in its "args" too. */
+static bool
+parse_object(struct parser *ps, struct event *ev)
+{
+    char key[32];
+    ps->p++;
+    skip_ws(ps);
+    if (*ps->p == '}') {
+        ps->p++;
+        return true;
+    }
+    for (;;) {
+        skip_ws(ps);
+        if (!parse_string(ps, key, sizeof key))
+            return false;
+        skip_ws(ps);
+        if (*ps->p++ != ':')
+            return false;
+        skip_ws(ps);
+        if (!parse_value(ps, ev, key))
+            return false;
+        skip_ws(ps);
+        if (*ps->p == '}') {
+            ps->p++;
+            return true;
+        }
+        if (*ps->p++ != ',')
+            return false;
+    }
+}
+
+static bool
+parse_array(struct parser *ps, bool (*element)(struct parser *, void *), void *aux)
+{
+    ps->p++;
+    skip_ws(ps);
+    if (*ps->p == ']') {
+        ps->p++;
+        return true;
+    }
+    for (;;) {
+        skip_ws(ps);
+        if (!element(ps, aux))
+            return false;
+        skip_ws(ps);
+        if (*ps->p == ']') {
+            ps->p++;
+            return true;
+        }
+        if (*ps->p++ != ',')
+            return false;
+    }
+}
+
+static bool
+any_element(struct parser *ps, void *aux)
+{
+    return parse_value(ps, NULL, NULL);
+}
+
+/* A value under 'key' of the object whose fields go to 'ev'. */
+static bool
+parse_value(struct parser *ps, struct event *ev, const char *key)
+{
+    char *str = NULL;
+    size_t size = 0;
+    double *num = NULL;
+
+    if (ev != NULL && key != NULL) {
+        if (strcmp(key, "name") == 0) {
+            str = ev->name;
+            size = sizeof ev->name;
+        } else if (strcmp(key, "ph") == 0) {
+            str = ev->ph;
+            size = sizeof ev->ph;
+        } else if (strcmp(key, "tid") == 0) {
+            num = &ev->tid;
+            ev->has_tid = true;
+        } else if (strcmp(key, "ts") == 0) {
+            ev->has_ts = true;
+        } else if (strcmp(key, "dur") == 0) {
+            ev->has_dur = true;
+        }
+    }
+
+    switch (*ps->p) {
+    case '{':
+        if (ev != NULL && key != NULL && strcmp(key, "args") == 0) {
+            /* only its name matters, as arg_name */
+            struct event args;
+            memset(&args, 0, sizeof args);
+            if (!parse_object(ps, &args))
+                return false;
+            strcpy(ev->arg_name, args.name);
+            return true;
+        }
+        return parse_object(ps, NULL);
+    case '[':
+        return parse_array(ps, any_element, NULL);
+    case '"':
+        return parse_string(ps, str, size);
+    case 't':
+        return strncmp(ps->p, "true", 4) == 0 && (ps->p += 4);
+    case 'f':
+        return strncmp(ps->p, "false", 5) == 0 && (ps->p += 5);
+    case 'n':
+        return strncmp(ps->p, "null", 4) == 0 && (ps->p += 4);
+    default:
+        return parse_number(ps, num);
+    }
+}
+
+/* One element of "traceEvents", tallied into the summary 'aux'. */
+static bool
+trace_event(struct parser *ps, void *aux)
+{
+    struct trace_summary *s = aux;
+    struct event ev;
+    memset(&ev, 0, sizeof ev);
+    if (*ps->p != '{' || !parse_object(ps, &ev))
+        return false;
+
+    if (strcmp(ev.ph, "M") == 0) {
+        if (strcmp(ev.name, "thread_name") == 0) {
+            char expect[32];
+            int track = (int) ev.tid;
+            snprintf(expect, sizeof expect, "worker %d", track);
+            s->ntracks++;
+            if (ev.has_tid && track >= 0 && track < s->nworkers
+                && strcmp(ev.arg_name, expect) == 0)
+                s->named[track] = true;
+        }
+        return true;
+    }
+    if (!ev.has_tid || !ev.has_ts || ev.tid < 0 || ev.tid >= s->nworkers)
+        s->bad_events++;
+    if (strcmp(ev.name, "task") == 0) {
+        if (strcmp(ev.ph, "X") != 0 || !ev.has_dur)
+            s->bad_events++;
+        s->ntasks++;
+    }
+    return true;
+}
+
+/* Parse the trace 'json' into 's'.  Returns false unless it is a
+ * single JSON object whose "traceEvents" is an array of events. */
+static bool
+check_trace(const char *json, struct trace_summary *s)
+{
+    struct parser ps = { .p = json };
+    char key[32];
+    bool events = false;
+
+    skip_ws(&ps);
+    if (*ps.p++ != '{')
+        return false;
+    for (;;) {
+        skip_ws(&ps);
+        if (!parse_string(&ps, key, sizeof key))
+            return false;
+        skip_ws(&ps);
+        if (*ps.p++ != ':')
+            return false;
+        skip_ws(&ps);
+        if (strcmp(key, "traceEvents") == 0) {
+            if (*ps.p != '[' || !parse_array(&ps, trace_event, s))
+                return false;
+            events = true;
+        } else if (!parse_value(&ps, NULL, NULL))
+            return false;
+        skip_ws(&ps);
+        if (*ps.p == '}')
+            break;
+        if (*ps.p++ != ',')
+            return false;
+    }
+    ps.p++;
+    skip_ws(&ps);
+    return events && *ps.p == '\0';
+}
+
+static char *
+read_file(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    char *buf = malloc(size + 1);
+    if (buf != NULL && fread(buf, 1, size, f) != (size_t) size) {
+        free(buf);
+        buf = NULL;
+    }
+    if (buf != NULL)
+        buf[size] = '\0';
+    fclose(f);
+    return buf;
+}
+
+/**********************************************************************************/
+
+static int
+run_test(int nthreads)
+{
+    char path[] = "/tmp/threadpool_test8.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        abort();
+    }
+    close(fd);
+
+    struct benchmark_data * bdata = start_benchmark();
+    struct thread_pool_options opts;
+    thread_pool_options_init(&opts, nthreads);
+    opts.trace_file = path;
+    struct thread_pool * threadpool = thread_pool_new_with_options(&opts);
+
+    struct future *f[NTASKS];
+    bool success = true;
+    int i;
+    atomic_store(&nran, 0);
+    for (i = 0; i < NTASKS; i++)
+        f[i] = thread_pool_submit(threadpool, parent_task, NULL);
+    for (i = 0; i < NTASKS; i++) {
+        if ((uintptr_t) future_get(f[i]) != NCHILDREN * (NCHILDREN - 1) / 2)
+            success = false;
+        future_free(f[i]);
+    }
+    thread_pool_shutdown_and_destroy(threadpool);
+
+    stop_benchmark(bdata);
+
+    char *json = read_file(path);
+    unlink(path);
+    struct trace_summary s = { .nworkers = nthreads, .named = calloc(nthreads, sizeof(bool)) };
+    if (json == NULL || !check_trace(json, &s)) {
+        fprintf(stderr, "Trace is not valid JSON\n");
+        success = false;
+    }
+    /* one track per worker, named after it */
+    if (s.ntracks != nthreads)
+        success = false;
+    for (i = 0; i < nthreads; i++)
+        if (!s.named[i])
+            success = false;
+    /* one slice per task that ran */
+    if (s.ntasks != atomic_load(&nran) || s.ntasks != NTASKS * (NCHILDREN + 1) || s.bad_events != 0)
+        success = false;
+
+    // consistency check
+    if (!success) {
+        fprintf(stderr, "Wrong result: %d tracks, %d task slices for %d tasks, %d bad events\n",
+                s.ntracks, s.ntasks, atomic_load(&nran), s.bad_events);
+        abort();
+    }
+
+    report_benchmark_results(bdata);
+    printf("Test successful.\n");
+    free(bdata);
+    free(json);
+    free(s.named);
+    return 0;
+}
+
+/**********************************************************************************/
+
+static void
+usage(char *av0, int exvalue)
+{
+    fprintf(stderr, "Usage: %s [-n <n>]\n"
+                    " -n number of threads in pool, default %d\n"
+                    , av0, DEFAULT_THREADS);
+    exit(exvalue);
+}
+
+int
+main(int ac, char *av[])
+{
+    int c, nthreads = DEFAULT_THREADS;
+    while ((c = getopt(ac, av, "n:h")) != EOF) {
+        switch (c) {
+        case 'n':
+            nthreads = atoi(optarg);
+            break;
+        case 'h':
+            usage(av[0], EXIT_SUCCESS);
+        }
+    }
+
+    return run_test(nthreads);
+}
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include "topology.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define SYSFS_NODE "/sys/devices/system/node"
+
+/* Reads the first line of PATH into BUF.  Returns false if the file
+   does not exist or is empty. */
+static bool
+read_line (const char *path, char *buf, size_t size)
+{
+  FILE *f = fopen (path, "r");
+  if (f == NULL)
+    return false;
+  bool ok = fgets (buf, size, f) != NULL;
+  fclose (f);
+  return ok;
+}
+
+/* Reads an integer from PATH, or returns DEFAULT_VALUE. */
+static int
+read_int (const char *path, int default_value)
+{
+  char buf[32];
+  if (!read_line (path, buf, sizeof buf))
+    return default_value;
+  return atoi (buf);
+}
+
+bool
+topology_parse_cpulist (const char *s, void (*fn) (int, void *), void *aux)
+{
+  while (*s != '\0' && *s != '\n')
+    {
+      char *end;
+      long lo = strtol (s, &end, 10);
+      if (end == s)
+        return false;
+      long hi = lo;
+      s = end;
+      if (*s == '-')
+        {
+          hi = strtol (s + 1, &end, 10);
+          if (end == s + 1 || hi < lo)
+            return false;
+          s = end;
+        }
+      long cpu;
+      for (cpu = lo; cpu <= hi; cpu++)
+        fn (cpu, aux);
+      if (*s == ',')
+        s++;
+    }
+  return true;
+}
+
+struct collect_aux {
+  struct topology *topo;
+  cpu_set_t *allowed;
+};
+
+static void
+collect_cpu (int cpu, void *aux_)
+{
+  struct collect_aux *aux = aux_;
+  struct topology *topo = aux->topo;
+  char path[128];
+
+  if (cpu >= CPU_SETSIZE || !CPU_ISSET (cpu, aux->allowed))
+    return;
+
+  struct cpu_info *ci = &topo->cpus[topo->ncpus++];
+  ci->cpu = cpu;
+  snprintf (path, sizeof path, SYSFS_CPU "/cpu%d/topology/physical_package_id", cpu);
+  ci->package = read_int (path, 0);
+  snprintf (path, sizeof path, SYSFS_CPU "/cpu%d/topology/core_id", cpu);
+  ci->core = read_int (path, cpu);
+  ci->node = 0;
+}
+
+struct node_aux {
+  struct topology *topo;
+  int node;
+};
+
+static void
+set_cpu_node (int cpu, void *aux_)
+{
+  struct node_aux *aux = aux_;
+  int i;
+  for (i = 0; i < aux->topo->ncpus; i++)
+    if (aux->topo->cpus[i].cpu == cpu)
+      aux->topo->cpus[i].node = aux->node;
+}
+
+static void
+read_node (int node, void *topo)
+{
+  char path[128], buf[4096];
+  struct node_aux aux = { .topo = topo, .node = node };
+
+  snprintf (path, sizeof path, SYSFS_NODE "/node%d/cpulist", node);
+  if (read_line (path, buf, sizeof buf))
+    topology_parse_cpulist (buf, set_cpu_node, &aux);
+}
+
+/* Computes smt_rank and core_rank.  Quadratic, but only run once
+   per pool on at most a few hundred CPUs. */
+static void
+compute_ranks (struct topology *topo)
+{
+  int i, j;
+  for (i = 0; i < topo->ncpus; i++)
+    {
+      struct cpu_info *a = &topo->cpus[i];
+      a->smt_rank = 0;
+      for (j = 0; j < topo->ncpus; j++)
+        {
+          struct cpu_info *b = &topo->cpus[j];
+          if (b->package == a->package && b->core == a->core
+              && b->cpu < a->cpu)
+            a->smt_rank++;
+        }
+    }
+
+  /* a core's rank is the number of smaller cores in its package,
+     each counted through its first hyperthread */
+  for (i = 0; i < topo->ncpus; i++)
+    {
+      struct cpu_info *a = &topo->cpus[i];
+      a->core_rank = 0;
+      for (j = 0; j < topo->ncpus; j++)
+        {
+          struct cpu_info *b = &topo->cpus[j];
+          if (b->package == a->package && b->core < a->core
+              && b->smt_rank == 0)
+            a->core_rank++;
+        }
+    }
+}
+
+/* Reads the topology of the CPUs this process may run on. */
+bool
+topology_read (struct topology *topo)
+{
+  char buf[4096];
+  cpu_set_t allowed;
+
+  topo->ncpus = 0;
+  topo->cpus = NULL;
+
+  if (sched_getaffinity (0, sizeof allowed, &allowed) != 0)
+    return false;
+  if (!read_line (SYSFS_CPU "/online", buf, sizeof buf))
+    return false;
+
+  topo->cpus = calloc (CPU_COUNT (&allowed), sizeof *topo->cpus);
+  if (topo->cpus == NULL)
+    return false;
+
+  struct collect_aux aux = { .topo = topo, .allowed = &allowed };
+  if (!topology_parse_cpulist (buf, collect_cpu, &aux) || topo->ncpus == 0)
+    {
+      topology_free (topo);
+      return false;
+    }
+  compute_ranks (topo);
+
+  /* without CONFIG_NUMA there is no node directory and every CPU
+     stays on node 0 */
+  if (read_line (SYSFS_NODE "/online", buf, sizeof buf))
+    topology_parse_cpulist (buf, read_node, topo);
+  return true;
+}
+
+bool
+topology_has_cpu (struct topology *topo, int cpu)
+{
+  int i;
+  for (i = 0; i < topo->ncpus; i++)
+    if (topo->cpus[i].cpu == cpu)
+      return true;
+  return false;
+}
+
+int
+topology_cpu_node (struct topology *topo, int cpu)
+{
+  int i;
+  for (i = 0; i < topo->ncpus; i++)
+    if (topo->cpus[i].cpu == cpu)
+      return topo->cpus[i].node;
+  return 0;
+}
+
+void
+topology_free (struct topology *topo)
+{
+  free (topo->cpus);
+  topo->cpus = NULL;
+  topo->ncpus = 0;
+}
+
+/* Orders CPUs for the "compact" policy: fill a core's hyperthreads,
+   then the cores of a package, then the next package. */
+static int
+compare_compact (const void *a_, const void *b_)
+{
+  const struct cpu_info *a = a_, *b = b_;
+  if (a->package != b->package)
+    return a->package - b->package;
+  if (a->core_rank != b->core_rank)
+    return a->core_rank - b->core_rank;
+  return a->smt_rank - b->smt_rank;
+}
+
+/* Orders CPUs for the "scatter" policy: consecutive workers go to
+   different packages, then different cores, and share a core's
+   hyperthreads only once every core has a worker. */
+static int
+compare_scatter (const void *a_, const void *b_)
+{
+  const struct cpu_info *a = a_, *b = b_;
+  if (a->smt_rank != b->smt_rank)
+    return a->smt_rank - b->smt_rank;
+  if (a->core_rank != b->core_rank)
+    return a->core_rank - b->core_rank;
+  return a->package - b->package;
+}
+
+void
+topology_place (struct topology *topo, enum thread_pool_placement policy,
+                int nworkers, int *cpus)
+{
+  struct cpu_info *order = malloc (topo->ncpus * sizeof *order);
+  int i, n = 0;
+
+  if (order == NULL)
+    {
+      for (i = 0; i < nworkers; i++)
+        cpus[i] = -1;
+      return;
+    }
+
+  for (i = 0; i < topo->ncpus; i++)
+    if (policy != THREAD_POOL_PLACE_PHYSICAL_CORE
+        || topo->cpus[i].smt_rank == 0)
+      order[n++] = topo->cpus[i];
+
+  qsort (order, n, sizeof *order,
+         policy == THREAD_POOL_PLACE_SCATTER ? compare_scatter
+                                             : compare_compact);
+
+  for (i = 0; i < nworkers; i++)
+    cpus[i] = order[i % n].cpu;
+  free (order);
+}
@@ -0,0 +1,48 @@
+#ifndef __TOPOLOGY_H
+#define __TOPOLOGY_H
+/* CPU topology as reported by /sys/devices/system/cpu and
+   /sys/devices/system/node.
+
+   Only CPUs that are online and in the calling process's affinity
+   mask are included, so placements computed from it never pin a
+   worker to a CPU it may not run on. */
+
+#include <stdbool.h>
+
+#include "threadpool.h"
+
+struct cpu_info {
+    int cpu;            /* logical CPU number */
+    int package;        /* physical_package_id */
+    int node;           /* NUMA node, 0 if the kernel has no NUMA support */
+    int core;           /* core_id, unique only within a package */
+    int core_rank;      /* index of this core among its package's cores */
+    int smt_rank;       /* index of this CPU among its core's hyperthreads */
+};
+
+struct topology {
+    int ncpus;
+    struct cpu_info *cpus;      /* sorted by CPU number */
+};
+
+bool topology_read (struct topology *);
+void topology_free (struct topology *);
+
+/* Whether CPU is online and in the process's affinity mask. */
+bool topology_has_cpu (struct topology *, int cpu);
+
+/* Returns the NUMA node of CPU, or 0 if CPU is unknown. */
+int topology_cpu_node (struct topology *, int cpu);
+
+/* Fills CPUS[0..NWORKERS-1] with the CPU each worker should be
+   pinned to under POLICY, wrapping around if there are more workers
+   than suitable CPUs. */
+void topology_place (struct topology *, enum thread_pool_placement policy,
+                     int nworkers, int *cpus);
+
+/* Calls FN (CPU, AUX) for every CPU in a kernel cpulist string such
+   as "0-3,8,10-11".  Returns false if the string is malformed. */
+bool topology_parse_cpulist (const char *, void (*fn) (int, void *),
+                             void *aux);
+
+#endif /* topology.h */
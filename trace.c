@@ -0,0 +1,107 @@
+#include "trace.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Initializes R as an empty ring of CAPACITY events.  CAPACITY
+   must be a power of two. */
+bool
+trace_init (struct trace_ring *r, size_t capacity)
+{
+  r->events = malloc (capacity * sizeof *r->events);
+  if (r->events == NULL)
+    return false;
+  r->mask = capacity - 1;
+  r->head = 0;
+  return true;
+}
+
+void
+trace_destroy (struct trace_ring *r)
+{
+  free (r->events);
+}
+
+/* Reads the trace clock and CLOCK_MONOTONIC as close together as
+   possible. */
+void
+trace_sync (struct trace_sync *s)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  s->ticks = trace_clock ();
+  s->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+trace_write_begin (FILE *f)
+{
+  fprintf (f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+           "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+           "\"args\":{\"name\":\"thread pool\"}}", (int) getpid ());
+}
+
+/* Names TRACK NAME, and sorts tracks by number. */
+void
+trace_write_track_name (FILE *f, uint32_t track, const char *name)
+{
+  int pid = getpid ();
+  fprintf (f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+           "\"tid\":%u,\"args\":{\"name\":\"%s\"}}", pid, track, name);
+  fprintf (f, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":%d,"
+           "\"tid\":%u,\"args\":{\"sort_index\":%u}}", pid, track, track);
+}
+
+/* Writes the events in R.  Timestamps are converted with the clock
+   readings FIRST and LAST, and made relative to FIRST. */
+void
+trace_write_events (FILE *f, const struct trace_ring *r,
+                    const struct trace_sync *first,
+                    const struct trace_sync *last)
+{
+  static const char *names[] = { "task", "spawn", "steal", "park" };
+  int pid = getpid ();
+  double ticks_per_us = 1000.0;
+  if (last->ns > first->ns && last->ticks > first->ticks)
+    ticks_per_us = (double) (last->ticks - first->ticks)
+                   / (last->ns - first->ns) * 1000.0;
+
+  /* a ring that wrapped around only holds its last mask + 1 events */
+  uint64_t i = r->head > r->mask + 1 ? r->head - (r->mask + 1) : 0;
+  for (; i < r->head; i++)
+    {
+      const struct trace_event *e = &r->events[i & r->mask];
+      double ts = (double) (int64_t) (e->start - first->ticks) / ticks_per_us;
+
+      fprintf (f, ",\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f",
+               names[e->type], pid, e->track, ts);
+      switch (e->type)
+        {
+        case TRACE_TASK:
+          fprintf (f, ",\"ph\":\"X\",\"dur\":%.3f,"
+                   "\"args\":{\"future\":\"%#lx\",\"priority\":%u}}",
+                   (e->end - e->start) / ticks_per_us,
+                   (unsigned long) e->id, e->arg);
+          break;
+        case TRACE_PARK:
+          fprintf (f, ",\"ph\":\"X\",\"dur\":%.3f}",
+                   (e->end - e->start) / ticks_per_us);
+          break;
+        case TRACE_SPAWN:
+          fprintf (f, ",\"ph\":\"i\",\"s\":\"t\","
+                   "\"args\":{\"future\":\"%#lx\"}}", (unsigned long) e->id);
+          break;
+        case TRACE_STEAL:
+          fprintf (f, ",\"ph\":\"i\",\"s\":\"t\","
+                   "\"args\":{\"future\":\"%#lx\",\"victim\":%u}}",
+                   (unsigned long) e->id, e->arg);
+          break;
+        }
+    }
+}
+
+void
+trace_write_end (FILE *f)
+{
+  fprintf (f, "\n]}\n");
+}
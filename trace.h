@@ -0,0 +1,95 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+/* Event tracing in the Chrome Trace Event format.
+
+   Each thread records events into a trace ring of its own, without
+   locks or atomic operations: a ring has a single writer, and it is
+   only read once that writer has stopped.  When a ring is full, new
+   events overwrite the oldest ones, so a ring always holds the most
+   recent events.
+
+   Timestamps are read from the time stamp counter where there is
+   one and from CLOCK_MONOTONIC otherwise.  trace_write_events()
+   converts them to microseconds using two pairs of counter and
+   clock readings taken some time apart.
+
+   The output is a JSON object with a "traceEvents" array, which
+   chrome://tracing and https://ui.perfetto.dev open directly.  Each
+   event belongs to a track, shown as a thread of the process. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+enum trace_type {
+    TRACE_TASK,                 /* a task ran from START to END */
+    TRACE_SPAWN,                /* a future was submitted */
+    TRACE_STEAL,                /* a future was stolen from worker ARG */
+    TRACE_PARK                  /* a worker slept from START to END */
+};
+
+struct trace_event {
+    uint64_t start, end;        /* END only for TRACE_TASK and TRACE_PARK */
+    uintptr_t id;               /* the future, if any */
+    uint32_t track;
+    uint16_t type;
+    uint16_t arg;
+};
+
+struct trace_ring {
+    struct trace_event *events;
+    uint64_t mask;
+    uint64_t head;              /* events recorded so far */
+};
+
+/* Clock readings for converting timestamps, see trace_sync(). */
+struct trace_sync {
+    uint64_t ticks;
+    uint64_t ns;
+};
+
+static inline uint64_t
+trace_clock (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc ();
+#else
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/* Records an event in R.  Only the ring's owner may call this. */
+static inline void
+trace_add (struct trace_ring *r, enum trace_type type, uint32_t track,
+           uint64_t start, uint64_t end, uintptr_t id, uint16_t arg)
+{
+  struct trace_event *e = &r->events[r->head++ & r->mask];
+  e->start = start;
+  e->end = end;
+  e->id = id;
+  e->track = track;
+  e->type = type;
+  e->arg = arg;
+}
+
+bool trace_init (struct trace_ring *, size_t capacity);
+void trace_destroy (struct trace_ring *);
+void trace_sync (struct trace_sync *);
+
+/* Writing a trace: trace_write_begin(), then any number of track
+   names and rings, then trace_write_end(). */
+void trace_write_begin (FILE *);
+void trace_write_track_name (FILE *, uint32_t track, const char *name);
+void trace_write_events (FILE *, const struct trace_ring *,
+                         const struct trace_sync *first,
+                         const struct trace_sync *last);
+void trace_write_end (FILE *);
+
+#endif /* trace.h */